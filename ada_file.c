@@ -14,42 +14,359 @@
 #include <linux/swap.h>
 #include <linux/sched.h>
 #include <linux/pagemap.h>
+#include <linux/moduleparam.h>
+#include <linux/capability.h>
+#include <linux/mutex.h>
+#include <linux/input.h>
+#include <linux/timer.h>
+#include <linux/slab.h>
 #include <asm/errno.h>
+#include <asm/uaccess.h>
 
 #include "ada_fs.h"
 #include "ada_policy.h"
 
 struct adafs_log *adafs_logs[MAX_LOG_NUM];
 static atomic_t num_logs;
+static DEFINE_MUTEX(adafs_logs_mutex); /* serializes creation of logs */
+static struct kset *adafs_kset;
 
 struct kmem_cache *adafs_rlog_cachep;
+HLIST_HEAD(adafs_rlog_spares);
+DEFINE_SPINLOCK(adafs_rlog_spare_lock);
+unsigned int adafs_rlog_nr_spares;
 
-struct shashtable *page_rlog = &(struct shashtable)
-		SHASHTABLE_UNINIT(RLOG_HASH_BITS);
+/* Grows with pages in logs, from RLOG_HASH_BITS to RLOG_HASH_MAX_BITS */
+static struct rcuhashtable adafs_page_rlog;
+struct rcuhashtable *page_rlog = &adafs_page_rlog;
 
-struct task_struct *adafs_flusher;
-struct completion flush_cmpl;
+struct kmem_cache *adafs_ispan_cachep;
 
-int adafs_flush(void *data)
+struct shashtable *inode_span = &(struct shashtable)
+		SHASHTABLE_UNINIT(ISPAN_HASH_BITS);
+
+/* Capacity in slots of logs created from now on, rounded to whole segments */
+unsigned int adafs_log_len = LOG_DEF_LEN;
+module_param(adafs_log_len, uint, 0644);
+MODULE_PARM_DESC(adafs_log_len, "Slots of a new adafs log");
+
+/* Ceiling of a new log growing under write bursts */
+unsigned int adafs_log_max_len = LOG_DEF_LEN << 2;
+module_param(adafs_log_max_len, uint, 0644);
+MODULE_PARM_DESC(adafs_log_max_len, "Max slots of a new adafs log");
+
+/*
+ * Idle windows of the user, predicted from input events of all input
+ * devices or written to the adafs_idle_event parameter. Threshold flushes
+ * deferred by adafs_kick_flush() are run in them, so that flush I/O keeps
+ * off the foreground. Timer events are relative to the latest input.
+ */
+struct adafs_idle adafs_idle;
+static DEFINE_SPINLOCK(adafs_idle_lock);
+static struct timer_list adafs_idle_timer;
+static unsigned long adafs_idle_timeout_ms = IDLE_INVAL;
+static u64 adafs_idle_last;	/* ms of the last event */
+
+int adafs_idle_sched = 1;
+module_param(adafs_idle_sched, int, 0644);
+MODULE_PARM_DESC(adafs_idle_sched, "Defer threshold flushes to predicted idle windows");
+module_param_named(idle_thr_int_ms, adafs_idle.thr_int, ulong, 0644);
+module_param_named(idle_thr_m, adafs_idle.thr_m, ulong, 0644);
+MODULE_PARM_DESC(idle_thr_m, "Multiple of input intervals to be idle after, in 1/256");
+module_param_named(idle_preds, adafs_idle.nr_preds, ulong, 0444);
+module_param_named(idle_conflicts, adafs_idle.nr_conflicts, ulong, 0444);
+
+#define adafs_now_ms()	div_u64(adafs_now_ns(), NSEC_PER_MSEC)
+
+/* Wakes flushers with flushes deferred to this idle window */
+static void adafs_idle_flush(void)
 {
-	int i;
 	struct adafs_log *log;
+	int i, n;
+
+	n = atomic_read(&num_logs);
+	smp_rmb();
+	for (i = 0; i < n; ++i) {
+		log = adafs_logs[i];
+		if (xchg(&log->l_idle_kick, 0))
+			wake_up_process(log->l_flusher);
+	}
+}
+
+static void __adafs_idle_arm(void)
+{
+	if (adafs_idle_timeout_ms == IDLE_INVAL)
+		del_timer(&adafs_idle_timer);
+	else
+		mod_timer(&adafs_idle_timer,
+				jiffies + msecs_to_jiffies(adafs_idle_timeout_ms));
+}
+
+/* Caller holds adafs_idle_lock */
+static void __adafs_idle_transfer(int ev, u64 now)
+{
+	adafs_idle_timeout_ms = idle_transfer(&adafs_idle, ev,
+			(unsigned long)(now - adafs_idle_last));
+	adafs_idle_last = now;
+	__adafs_idle_arm();
+	if (!idle_busy(&adafs_idle))
+		adafs_idle_flush();
+}
+
+static void adafs_idle_timer_fn(unsigned long data)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&adafs_idle_lock, flags);
+	__adafs_idle_transfer(EV_TIMER, adafs_now_ms());
+	spin_unlock_irqrestore(&adafs_idle_lock, flags);
+}
+
+/* Takes an input event, in any context */
+void adafs_idle_event(void)
+{
+	unsigned long flags;
+	u64 now = adafs_now_ms();
+
+	spin_lock_irqsave(&adafs_idle_lock, flags);
+	if (now - adafs_idle_last > IDLE_MIN_INT) {
+		__adafs_idle_transfer(EV_USER, now);
+	} else {
+		// Events of one gesture are one
+		adafs_idle_last = now;
+		__adafs_idle_arm();
+	}
+	spin_unlock_irqrestore(&adafs_idle_lock, flags);
+}
+
+static int adafs_idle_event_set(const char *val, const struct kernel_param *kp)
+{
+	adafs_idle_event();
+	return 0;
+}
+
+static struct kernel_param_ops adafs_idle_event_ops = {
+	.set = adafs_idle_event_set,
+};
+module_param_cb(adafs_idle_event, &adafs_idle_event_ops, NULL, 0200);
+MODULE_PARM_DESC(adafs_idle_event, "Written on input events not seen by input handlers");
+
+static void adafs_input_event(struct input_handle *handle,
+		unsigned int type, unsigned int code, int value)
+{
+	if (type == EV_KEY || type == EV_ABS || type == EV_REL)
+		adafs_idle_event();
+}
+
+static int adafs_input_connect(struct input_handler *handler,
+		struct input_dev *dev, const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int err;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "adafs";
+
+	err = input_register_handle(handle);
+	if (err)
+		goto err_free;
+	err = input_open_device(handle);
+	if (err)
+		goto err_unregister;
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return err;
+}
+
+static void adafs_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id adafs_input_ids[] = {
+	{ .flags = INPUT_DEVICE_ID_MATCH_EVBIT, .evbit = { BIT_MASK(EV_KEY) } },
+	{ .flags = INPUT_DEVICE_ID_MATCH_EVBIT, .evbit = { BIT_MASK(EV_ABS) } },
+	{ .flags = INPUT_DEVICE_ID_MATCH_EVBIT, .evbit = { BIT_MASK(EV_REL) } },
+	{ },
+};
+
+static struct input_handler adafs_input_handler = {
+	.event		= adafs_input_event,
+	.connect	= adafs_input_connect,
+	.disconnect	= adafs_input_disconnect,
+	.name		= "adafs",
+	.id_table	= adafs_input_ids,
+};
+
+/*
+ * Each log has its own flusher thread, so logs flush in parallel, and
+ * writers blocked on a full log wait only for that log.
+ */
+int adafs_flush(void *data)
+{
+	struct adafs_log *log = (struct adafs_log *)data;
 	while (!kthread_should_stop()) {
-		INIT_COMPLETION(flush_cmpl);
-		for (i = 0; i < atomic_read(&num_logs); ++i) {
-			log = adafs_logs[i];
-			while (log_flush(log, UINT_MAX) == -ENODATA &&
-					log->l_head != log->l_end) {
-				log_seal(log);
-			}
+		INIT_COMPLETION(log->l_fcmpl);
+		while (log_flush(log, UINT_MAX) == -ENODATA &&
+				log->l_head != log->l_end) {
+			log_seal(log);
+		}
+		// Gives back segments grown for a burst once it is over
+		if (ACCESS_ONCE(log->l_shrink) || log->l_begin == log->l_end) {
+			log->l_shrink = 0;
+			log_shrink(log);
 		}
-		complete_all(&flush_cmpl);
+		complete_all(&log->l_fcmpl);
+		wake_up_all(&log->l_wq);
 		set_current_state(TASK_INTERRUPTIBLE);
 		schedule();
 	}
 	return 0;
 }
 
+/*
+ * Under memory pressure, frees pooled COW pages of the logs, and asks the
+ * flusher to free segments beyond their initial capacity. Segments are
+ * freed after a grace period, which the reclaim path should not wait for.
+ */
+static int adafs_shrink_logs(struct shrinker *s, struct shrink_control *sc)
+{
+	struct adafs_log *log;
+	int i, n, nr = 0;
+
+	n = atomic_read(&num_logs);
+	smp_rmb();
+	for (i = 0; i < n; ++i) {
+		log = adafs_logs[i];
+		nr += cow_pages_shrink(log, sc->nr_to_scan);
+		if (log->l_len <= log->l_min_len) continue;
+		nr += (log->l_len - log->l_min_len) >> LOG_SEG_SHIFT;
+		if (sc->nr_to_scan) {
+			log->l_shrink = 1;
+			wake_up_process(log->l_flusher);
+		}
+	}
+	return nr;
+}
+
+static struct shrinker adafs_log_shrinker = {
+	.shrink = adafs_shrink_logs,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Creates a log, exported as log<index> in sysfs, and returns its index.
+ * Logs live until the module exits, so readers of adafs_logs only need
+ * to see the count after the pointer.
+ */
+int adafs_new_log(void)
+{
+	struct adafs_log *log;
+	int li, err;
+
+	mutex_lock(&adafs_logs_mutex);
+	li = atomic_read(&num_logs);
+	if (li >= MAX_LOG_NUM) {
+		err = -ENOSPC;
+		goto out;
+	}
+	log = new_log(adafs_kset, adafs_log_len, adafs_log_max_len);
+	if (!log) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = kobject_init_and_add(&log->l_kobj, &adafs_la_ktype, NULL,
+	            "log%d", li);
+	if (err) printk(KERN_ERR "[adafs] kobject_init_and_add() failed for log%d\n", li);
+
+	log->l_flusher = kthread_run(adafs_flush, log, "adafs_flush%d", li);
+	if (IS_ERR(log->l_flusher)) {
+		err = PTR_ERR(log->l_flusher);
+		printk(KERN_ERR "[adafs] kthread_run() failed for log%d: %d\n", li, err);
+		log_destroy(log);
+		kfree(log);
+		goto out;
+	}
+
+	adafs_logs[li] = log;
+	smp_wmb();
+	atomic_set(&num_logs, li + 1);
+	err = li;
+	printk(KERN_INFO "[adafs] log%d created\n", li);
+out:
+	mutex_unlock(&adafs_logs_mutex);
+	return err;
+}
+
+/*
+ * Binds the directory of @parent and the inodes of its cached children to
+ * log @li, so that files already looked up follow as those read in later
+ * do. Only inodes without pages can follow, see __adafs_follow_dir().
+ * Cached inodes deeper below stay until they are read in again.
+ */
+static void adafs_set_dir_log(struct dentry *parent, int li)
+{
+	struct inode *dir = parent->d_inode;
+	struct dentry *child;
+	int nr_stay = 0;
+
+	dir->i_private = (void *)(long)li;
+	spin_lock(&parent->d_lock);
+	list_for_each_entry(child, &parent->d_subdirs, d_u.d_child) {
+		spin_lock_nested(&child->d_lock, DENTRY_D_LOCK_NESTED);
+		if (child->d_inode && !__adafs_follow_dir(dir, child->d_inode) &&
+				child->d_inode->i_private != dir->i_private)
+			++nr_stay;
+		spin_unlock(&child->d_lock);
+	}
+	spin_unlock(&parent->d_lock);
+	ADAFS_DEBUG(KERN_INFO "[adafs] adafs_set_dir_log(): %lu to log(%d), %d stay\n",
+			dir->i_ino, li, nr_stay);
+}
+
+/* Returns -ENOTTY for commands that are not of AdaFS */
+long adafs_ioctl_hook(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	int li;
+
+	switch (cmd) {
+	case ADAFS_IOC_NEW_LOG:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return adafs_new_log();
+	case ADAFS_IOC_GET_LOG:
+		return put_user((int)(long)inode->i_private, (int __user *)arg);
+	case ADAFS_IOC_SET_LOG:
+		// Files created or read in below the directory from now on
+		// go to the log, and so do its cached children without pages.
+		// Those with pages stay in their logs.
+		if (!S_ISDIR(inode->i_mode))
+			return -ENOTDIR;
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+		if (get_user(li, (int __user *)arg))
+			return -EFAULT;
+		if (li < 0 || li >= atomic_read(&num_logs))
+			return -EINVAL;
+		adafs_set_dir_log(filp->f_dentry, li);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
 int adafs_init_hook(const struct flush_operations *fops, struct kset *kset)
 {
 	int err;
@@ -58,57 +375,90 @@ int adafs_init_hook(const struct flush_operations *fops, struct kset *kset)
 			0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
 	adafs_tran_cachep = kmem_cache_create("adafs_tran_cachep", sizeof(struct transaction),
 			0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
-	if (!adafs_rlog_cachep || !adafs_tran_cachep)
+	adafs_ispan_cachep = kmem_cache_create("adafs_ispan_cache", sizeof(struct ispan),
+			0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
+	if (!adafs_rlog_cachep || !adafs_tran_cachep || !adafs_ispan_cachep)
 		return -ENOMEM;
+	for (adafs_rlog_nr_spares = 0; adafs_rlog_nr_spares < RLOG_SPARES;
+			++adafs_rlog_nr_spares) {
+		struct rlog *rl = kmem_cache_alloc(adafs_rlog_cachep, GFP_KERNEL);
+		if (!rl)
+			return -ENOMEM;
+		hlist_add_head(&rl->rl_hnode, &adafs_rlog_spares);
+	}
 
-	sht_init(page_rlog);
+	err = rcuht_init(page_rlog, struct rlog, rl_page, rl_hnode,
+			RLOG_HASH_BITS, RLOG_HASH_MAX_BITS);
+	if (err)
+		return err;
+	sht_init(inode_span);
 
-	atomic_set(&num_logs, 1);
-	adafs_logs[0] = new_log(kset);
+	if (fops) flush_ops = *fops;
 
-	err = kobject_init_and_add(&adafs_logs[0]->l_kobj, &adafs_la_ktype, NULL,
-	            "log%d", 0);
-	if (err) printk(KERN_ERR "[adafs] kobject_init_and_add() failed for log0\n");
+	atomic_set(&num_logs, 0);
+	adafs_kset = kset;
+	err = adafs_new_log();
+	if (err < 0)
+		return err;
 
-	if (fops) flush_ops = *fops;
+	register_shrinker(&adafs_log_shrinker);
 
-	adafs_flusher = kthread_run(adafs_flush, NULL, "adafs_flusher");
-	init_completion(&flush_cmpl);
-	if (IS_ERR(adafs_flusher)) {
-		printk(KERN_ERR "[adafs] kthread_run() failed: %ld\n", PTR_ERR(adafs_flusher));
-		return PTR_ERR(adafs_flusher);
-	}
+	idle_init(&adafs_idle);
+	adafs_idle_last = adafs_now_ms();
+	adafs_idle_timeout_ms = adafs_idle.thr_int;
+	setup_timer(&adafs_idle_timer, adafs_idle_timer_fn, 0);
+	__adafs_idle_arm();
+	if (input_register_handler(&adafs_input_handler))
+		printk(KERN_ERR "[adafs] input handler not registered; "
+				"idle windows follow adafs_idle_event only.\n");
 	return 0;
 }
 
 void adafs_exit_hook(void)
 {
-	int i, j;
+	int i;
+	unsigned int b;
 	struct sht_list *sl;
 	struct hlist_head *hl;
 	struct hlist_node *pos, *tmp;
 	struct rlog *rl;
+	struct ispan *is;
 
-	if (kthread_stop(adafs_flusher) != 0) {
-		printk(KERN_INFO "[adafs] adafs_flusher thread exits unclearly.\n");
+	unregister_shrinker(&adafs_log_shrinker);
+	input_unregister_handler(&adafs_input_handler);
+	del_timer_sync(&adafs_idle_timer);
+	for (i = 0; i < atomic_read(&num_logs); ++i) {
+		if (kthread_stop(adafs_logs[i]->l_flusher) != 0) {
+			printk(KERN_INFO "[adafs] flusher of log%d exits unclearly.\n", i);
+		}
 	}
 
 	i = 0;
-	j = (1 << (RLOG_HASH_BITS - 3));
-	for_each_hlist_safe(page_rlog, sl, hl) {
-		hlist_for_each_entry_safe(rl, pos, tmp, hl, rl_hnode) {
-			evict_rlog(rl);
-			++i;
-		}
-		if (--j == 0) {
-			printk(KERN_INFO "[adafs] adafs_exit_hook: evicted rlogs num=%d\n", i);
-			i = 0;
-			j = (1 << (RLOG_HASH_BITS - 3));
-		}
+	cancel_work_sync(&page_rlog->grow_work);
+	rcuht_for_each_safe(page_rlog, b, pos, tmp) {
+		rl = hlist_entry(pos, struct rlog, rl_hnode);
+		evict_rlog(page_rlog, rl);
+		++i;
+	}
+	printk(KERN_INFO "[adafs] adafs_exit_hook: evicted rlogs num=%d\n", i);
+	rcu_barrier(); // spares come back by call_rcu()
+	rcuht_destroy(page_rlog);
+	hlist_for_each_safe(pos, tmp, &adafs_rlog_spares) {
+		rl = hlist_entry(pos, struct rlog, rl_hnode);
+		rlog_free(rl);
 	}
 	kmem_cache_destroy(adafs_rlog_cachep);
 
+	for_each_hlist_safe(inode_span, sl, hl) {
+		hlist_for_each_entry_safe(is, pos, tmp, hl, is_hnode) {
+			hlist_del(&is->is_hnode);
+			ispan_free(is);
+		}
+	}
+	kmem_cache_destroy(adafs_ispan_cachep);
+
 	for (i = 0; i < atomic_read(&num_logs); ++i) {
+		cow_pages_shrink(adafs_logs[i], UINT_MAX);
 		log_destroy(adafs_logs[i]);
 		kfree(adafs_logs[i]);
 	}
@@ -120,19 +470,23 @@ void adafs_put_super_hook(void)
 #ifdef ADA_RELEASE
 	struct adafs_log *log;
 	int i;
-	int done = 1;
-	do {
-		wake_up_process(adafs_flusher);
-		if (wait_for_completion_interruptible(&flush_cmpl) < 0) {
-			printk(KERN_ERR "[adafs] adafs_put_super_hook "
-					"interrupted in waiting for flush_cmpl.\n");
-			return;
-		}
-		for (i = 0; i < atomic_read(&num_logs); ++i) {
-			log = adafs_logs[i];
-			if (log->l_begin != log->l_end) done = 0;
+
+	// Flushers of all logs work at the same time
+	for (i = 0; i < atomic_read(&num_logs); ++i) {
+		wake_up_process(adafs_logs[i]->l_flusher);
+	}
+	for (i = 0; i < atomic_read(&num_logs); ++i) {
+		log = adafs_logs[i];
+		for (;;) {
+			if (wait_for_completion_interruptible(&log->l_fcmpl) < 0) {
+				printk(KERN_ERR "[adafs] adafs_put_super_hook "
+						"interrupted in waiting for l_fcmpl.\n");
+				return;
+			}
+			if (log->l_begin == log->l_end) break;
+			wake_up_process(log->l_flusher);
 		}
-	} while(!done);
+	}
 #endif
 }
 
@@ -193,7 +547,15 @@ again:
 			flush_dcache_page(page);
 
 		/* AdaFS */
-		if (!re_entry) rl = adafs_try_assoc_rlog(mapping->host, page);
+		if (!re_entry) {
+			rl = adafs_try_assoc_rlog(mapping->host, page);
+			if (unlikely(!rl)) {
+				a_ops->write_end(file, mapping, pos, bytes, 0,
+						page, fsdata);
+				status = -ENOMEM;
+				break;
+			}
+		}
 
 		pagefault_disable();
 		copied = iov_iter_copy_from_user_atomic(page, i, offset, bytes);
@@ -229,6 +591,7 @@ again:
 
 		/* AdaFS */
 		adafs_try_append_log(mapping->host, rl, offset, copied);
+		adafs_balance_log(mapping->host);
 
 //		balance_dirty_pages_ratelimited(mapping);
 
@@ -343,6 +706,8 @@ ssize_t adafs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	ssize_t ret;
 
 	BUG_ON(iocb->ki_pos != pos);
+	if (!adafs_inode_logged(inode))
+		return generic_file_aio_write(iocb, iov, nr_segs, pos);
 
 	mutex_lock(&inode->i_mutex);
 	blk_start_plug(&plug);
@@ -350,13 +715,14 @@ ssize_t adafs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	ret = __adafs_file_aio_write(iocb, iov, nr_segs, &iocb->ki_pos);
 	mutex_unlock(&inode->i_mutex);
 
-//	if (ret > 0 || ret == -EIOCBQUEUED) {
-//		ssize_t err;
-//
-//		err = generic_write_sync(file, pos, ret);
-//		if (err < 0 && ret > 0)
-//			ret = err;
-//	}
+	// Only files opted into durable fsync, see adafs_fsync_hook()
+	if (ret > 0 || ret == -EIOCBQUEUED) {
+		ssize_t err;
+
+		err = generic_write_sync(file, pos, ret);
+		if (err < 0 && ret > 0)
+			ret = err;
+	}
 	blk_finish_plug(&plug);
 	return ret;
 }
@@ -17,23 +17,40 @@
 #include "ada_log.h"
 #include "ada_rlog.h"
 #include "ada_policy.h"
+#include "ada_policy_idle.h"
 
 #define MAX_LOG_NUM 16
 #define RLOG_HASH_BITS 10
+#define RLOG_HASH_MAX_BITS 20
+#define ISPAN_HASH_BITS 10
+
+/* Logs are created at runtime and bound to directories by ioctl */
+#define ADAFS_IOC_MAGIC		0xAD
+#define ADAFS_IOC_NEW_LOG	_IO(ADAFS_IOC_MAGIC, 1)
+#define ADAFS_IOC_GET_LOG	_IOR(ADAFS_IOC_MAGIC, 2, int)
+#define ADAFS_IOC_SET_LOG	_IOW(ADAFS_IOC_MAGIC, 3, int)
 
 struct kiocb;
 extern struct adafs_log *adafs_logs[MAX_LOG_NUM];
-extern struct task_struct *adafs_flusher;
-extern struct completion flush_cmpl;
 extern struct kmem_cache *adafs_rlog_cachep;
-extern struct shashtable *page_rlog;
+extern struct rcuhashtable *page_rlog;
+extern struct shashtable *inode_span;
+extern struct adafs_idle adafs_idle;
+extern int adafs_idle_sched;
 
 struct flush_operations {
 	handle_t *(*trans_begin)(struct inode *inode, int nles);
 	int (*entry_flush)(handle_t *handle,
 			struct log_entry *le, struct writeback_control *wbc);
+	/* Pages of @les are consecutive in one file, locked by the caller */
+	int (*entry_flush_range)(handle_t *handle, struct log_entry **les,
+			unsigned int nr, struct writeback_control *wbc);
 	int (*trans_end)(handle_t *handle);
 	int (*wait_sync)(struct inode *inode, tid_t commit_tid);
+	/* Group commit: max entries per handle, and wait_sync in two halves */
+	int (*trans_max)(struct inode *inode);
+	int (*wait_io)(struct inode *inode);
+	int (*wait_commit)(struct inode *inode, tid_t commit_tid);
 };
 
 /* Hooks */
@@ -42,6 +59,107 @@ extern void adafs_exit_hook(void);
 
 extern void adafs_put_super_hook(void);
 
+extern int adafs_new_log(void);
+extern long adafs_ioctl_hook(struct file *filp, unsigned int cmd, unsigned long arg);
+
+/*
+ * Wakes the flusher of a full log and waits until slots are released,
+ * which happens as flushed groups complete, or its round ends.
+ */
+static inline int adafs_wait_flush(struct adafs_log *log)
+{
+	unsigned int begin = ACCESS_ONCE(log->l_begin);
+	u64 t = adafs_now_ns();
+	int err;
+
+	wake_up_process(log->l_flusher);
+	err = wait_event_interruptible(log->l_wq,
+			ACCESS_ONCE(log->l_begin) != begin ||
+			completion_done(&log->l_fcmpl));
+	log_stall_add(log, adafs_now_ns() - t);
+	return err;
+}
+
+/*
+ * Throttles a writer by the watermarks of its log, as
+ * balance_dirty_pages() does, with no page locked. Beyond the low
+ * watermark the flusher is started if it is idle, regardless of idle
+ * windows. Beyond the high one the writer pauses, and is woken early once
+ * completed groups free slots below it.
+ */
+static inline void adafs_balance_log(struct inode *host)
+{
+	struct adafs_log *log = adafs_logs[(long)host->i_private];
+	unsigned int pause;
+	u64 t;
+
+	if (log_used(log) < log_wmark(log, ACCESS_ONCE(log->l_wmark_low)))
+		return;
+	if (completion_done(&log->l_fcmpl))
+		wake_up_process(log->l_flusher);
+
+	pause = log_wmark_pause(log);
+	if (!pause) return;
+	t = adafs_now_ns();
+	wait_event_interruptible_timeout(log->l_wq, log_used(log) <=
+			log_wmark(log, ACCESS_ONCE(log->l_wmark_high)),
+			msecs_to_jiffies(pause));
+	log_stall_add(log, adafs_now_ns() - t);
+}
+
+/*
+ * Wakes the flusher for a staleness threshold. While the user interacts
+ * and the log is used below its low watermark, the flush is deferred to
+ * the next predicted idle window, when adafs_idle_flush() wakes it.
+ */
+static inline void adafs_kick_flush(struct adafs_log *log)
+{
+	if (adafs_idle_sched && idle_busy(&adafs_idle) &&
+			log_used(log) < log_wmark(log, ACCESS_ONCE(log->l_wmark_low))) {
+		ACCESS_ONCE(log->l_idle_kick) = 1;
+		return;
+	}
+	wake_up_process(log->l_flusher);
+}
+
+extern void adafs_idle_event(void);
+
+/*
+ * Adds entry @ei to the span of @inode. Spans stay incomplete up to an
+ * entry whose span cannot be allocated, and until it is flushed, inodes
+ * are looked up in the whole log by adafs_ispan_get().
+ */
+static inline void adafs_ispan_add(struct adafs_log *log, struct inode *inode,
+		unsigned int ei)
+{
+	if (unlikely(ispan_add(inode_span, inode, ei, ACCESS_ONCE(log->l_begin))))
+		ACCESS_ONCE(log->l_ispan_lost) = ei;
+}
+
+/* Gets the span of the unflushed entries of @inode, see adafs_ispan_add() */
+static inline int adafs_ispan_get(struct adafs_log *log, struct inode *inode,
+		unsigned int *first, unsigned int *last)
+{
+	unsigned int lost = ACCESS_ONCE(log->l_ispan_lost);
+
+	if (unlikely(lost != L_NULL)) {
+		if (!seq_less(lost, ACCESS_ONCE(log->l_begin))) {
+			*first = ACCESS_ONCE(log->l_begin);
+			*last = ACCESS_ONCE(log->l_end) - 1;
+			return 0;
+		}
+		cmpxchg(&log->l_ispan_lost, lost, L_NULL);
+	}
+	return ispan_get(inode_span, inode, first, last);
+}
+
+/*
+ * Entries keep 32 bits of an inode number, so files with larger ones are
+ * not logged and go down the normal writeback path.
+ */
+#define adafs_inode_logged(inode) \
+		(S_ISREG((inode)->i_mode) && (inode)->i_ino < LE_INVAL_INO)
+
 static inline void adafs_new_inode_hook(struct inode *dir, struct inode *new_inode, int mode)
 {
 	if (dir) {
@@ -50,23 +168,31 @@ static inline void adafs_new_inode_hook(struct inode *dir, struct inode *new_ino
 				dir->i_ino, new_inode->i_ino, (unsigned long)dir->i_private);
 	}
 
-	if (S_ISREG(mode)) {
+	if (S_ISREG(mode) && new_inode->i_ino < LE_INVAL_INO) {
 		struct log_entry le = LE_INITIALIZER;
 		struct adafs_log *log = adafs_logs[(long)new_inode->i_private];
+		unsigned int ei = L_NULL;
 		le_set_ino(&le, new_inode->i_ino);
 		le_set_meta(&le);
-		while (log_append(log, &le, NULL) == -EAGAIN) {
+		while (log_append(log, &le, &ei) == -EAGAIN) {
+			if (!log_grow(log)) continue;
 			log_seal(log);
-			wake_up_process(adafs_flusher);
-			if (wait_for_completion_interruptible(&flush_cmpl) < 0) {
+			if (adafs_wait_flush(log) < 0) {
 				printk(KERN_ERR "[adafs] adafs_new_inode_hook "
-						"interrupted in waiting for flush_cmpl.\n");
+						"interrupted in waiting for flush.\n");
 				break;
 			}
 		}
+		if (ei != L_NULL)
+			adafs_ispan_add(log, new_inode, ei);
 	}
 }
 
+/*
+ * Binds a locked page to be written to its rlog, copying it first if its
+ * entry is sealed. Returns NULL if rlogs or a copy cannot be had without
+ * sleeping, when the page is left as it was and the write fails.
+ */
 static inline struct rlog *adafs_try_assoc_rlog(struct inode *host,
 		struct page* page)
 {
@@ -79,16 +205,26 @@ static inline struct rlog *adafs_try_assoc_rlog(struct inode *host,
 	rl = find_rlog(page_rlog, page);
 
 	if (!rl) { // new page
-        rl = rlog_malloc();
+        rl = rlog_get_spare();
+        if (unlikely(!rl)) return NULL;
         assoc_rlog(rl, page, L_NULL, page_rlog);
 #ifdef DEBUG_PRP
         printk(KERN_DEBUG "[adafs] NP 1: %p\n", rl_page(rl));
 #endif
 	} else if (seq_less(rl_enti(rl), log->l_head)) { // COW
-		struct page *cpage = page_cache_alloc_cold(&host->i_data);
+		struct page *cpage;
 		void *vfrom, *vto;
-		struct log_entry *le;
-		struct rlog* nrl;
+		struct log_entry *le = L_ENT(log, rl_enti(rl));
+		struct rlog *nrl, *srl = NULL, *crl = NULL;
+
+		// Spares first, for the page and a copy in a range
+		if (rl->rl_pool == RL_SLOT && !(srl = rlog_get_spare()))
+			goto nomem;
+		if (le_range(le) && !(crl = rlog_get_spare()))
+			goto nomem;
+		cpage = cow_page_get(log, &host->i_data);
+		if (unlikely(!cpage))
+			goto nomem;
 
 		vfrom = kmap_atomic(page, KM_USER0);
 		vto = kmap_atomic(cpage, KM_USER1);
@@ -96,20 +232,33 @@ static inline struct rlog *adafs_try_assoc_rlog(struct inode *host,
 		kunmap_atomic(vfrom, KM_USER0);
 		kunmap_atomic(vto, KM_USER1);
 
-		cpage->flags = page->flags;
+		// Not the flags of the page, which hold its zone and lock bits
+		SetPageUptodate(cpage);
 		cpage->mapping = page->mapping; // for retrieval of inode
 		cpage->index = page->index;
 
-		nrl = rlog_malloc();
-		assoc_rlog(nrl, cpage, rl_enti(rl), page_rlog);
+		if (le_range(le)) {
+			range_add_copy(log, rl_enti(rl), cpage, crl);
+		} else {
+			nrl = L_CRLOG(log, rl_enti(rl));
+			nrl->rl_pool = RL_COPY;
+			assoc_rlog(nrl, cpage, rl_enti(rl), page_rlog);
+			le_set_ref(le, cpage);
+			le_set_cow(le);
+		}
 
-		le = L_ENT(log, rl_enti(nrl));
-		le_set_ref(le, cpage);
-		le_set_cow(le);
+		// The slot goes with the flushed copy, so the page waits on a spare
+		if (srl)
+			rl = move_rlog(page_rlog, rl, srl, rl_enti(rl));
 
 #ifdef DEBUG_PRP
 		printk(KERN_DEBUG "[adafs] COW 1: %p\n", rl_page(rl));
 #endif
+		return rl;
+nomem:
+		if (srl) rlog_put_spare(srl);
+		if (crl) rlog_put_spare(crl);
+		return NULL;
 	}
 #ifdef DEBUG_PRP
 	else printk(KERN_DEBUG "[adafs] AP 1: %p - %u - %u\n", rl_page(rl), rl_enti(rl), log->l_head);
@@ -118,6 +267,52 @@ static inline struct rlog *adafs_try_assoc_rlog(struct inode *host,
 	return rl;
 }
 
+/*
+ * Extends the active entry of the page before the new page of @rl to
+ * cover it, so that a sequential write takes one slot per LE_MAX_PAGES
+ * pages. Only a data entry ending in that full page is extended, and only
+ * before it is sealed. l_tlock orders it against the seal and against
+ * writers updating the length of the entry. Returns 0 if extended.
+ */
+static inline int adafs_try_extend_range(struct adafs_log *log,
+		struct inode *host, struct rlog *rl, unsigned long len)
+{
+	pgoff_t index = rl_page(rl)->index;
+	struct log_entry *le;
+	struct page *prev;
+	struct rlog *prl;
+	unsigned int ei;
+	int err = -ENOENT;
+
+	if (!index || rl_enti(rl) != L_NULL)
+		return err;
+	prev = find_get_page(host->i_mapping, index - 1);
+	if (!prev)
+		return err;
+	// The rlog of a page not locked may be evicted and reused
+	rcu_read_lock();
+	prl = find_rlog(page_rlog, prev);
+	ei = prl ? ACCESS_ONCE(prl->rl_enti) : L_NULL;
+	rcu_read_unlock();
+	put_page(prev);
+	if (ei == L_NULL)
+		return err;
+
+	le = L_ENT(log, ei);
+	spin_lock(&log->l_tlock);
+	if (seq_ng(log->l_head, ei) && seq_less(ei, ACCESS_ONCE(log->l_end)) &&
+			le_ino(le) == host->i_ino && !le_meta(le) && !le_cow(le) &&
+			le_last_pgi(le) == index - 1 && le_len(le) == PAGE_CACHE_SIZE &&
+			le_nr_pages(le) < LE_MAX_PAGES) {
+		rl_set_enti(rl, ei);
+		le_set_nr_pages(le, le_nr_pages(le) + 1);
+		le_set_len(le, len);
+		err = 0;
+	}
+	spin_unlock(&log->l_tlock);
+	return err;
+}
+
 static inline int adafs_try_append_log(struct inode *host, struct rlog* rl,
 		unsigned long offset, unsigned long copied)
 {
@@ -128,11 +323,22 @@ static inline int adafs_try_append_log(struct inode *host, struct rlog* rl,
 	BUG_ON(li > MAX_LOG_NUM);
 
 	if (rl_enti(rl) != L_NULL && seq_ng(log->l_head, rl_enti(rl))) { // active page
-		le_set_len(L_ENT(log, rl_enti(rl)), offset + copied);
+		struct log_entry *le = L_ENT(log, rl_enti(rl));
+		// Flags are shared with adafs_try_extend_range() of the next page
+		spin_lock(&log->l_tlock);
+		if (rl_page(rl)->index == le_last_pgi(le) &&
+				offset + copied > le_len(le))
+			le_set_len(le, offset + copied);
+		spin_unlock(&log->l_tlock);
 #ifdef DEBUG_PRP
 		printk(KERN_DEBUG "[adafs] AP 2: %p - %u - %u\n", rl_page(rl), rl_enti(rl), log->l_head);
 #endif
 		on_write_old_page(log, copied);
+	} else if (!adafs_try_extend_range(log, host, rl, offset + copied)) {
+#ifdef DEBUG_PRP
+		printk(KERN_DEBUG "[adafs] RP 2: %p - %u\n", rl_page(rl), rl_enti(rl));
+#endif
+		on_write_new_page(log, copied);
 	} else {
 		unsigned int ei = L_NULL, pgv;
 		struct log_entry le = LE_INITIALIZER;
@@ -152,27 +358,75 @@ static inline int adafs_try_append_log(struct inode *host, struct rlog* rl,
 		else printk(KERN_DEBUG "[adafs] NP 2: %p\n", rl_page(rl));
 #endif
 		while (log_append(log, &le, &ei) == -EAGAIN) {
+			if (!log_grow(log)) continue;
 			log_seal(log);
-			wake_up_process(adafs_flusher);
-			if (wait_for_completion_interruptible(&flush_cmpl) < 0) {
+			if (adafs_wait_flush(log) < 0) {
 				printk(KERN_ERR "[adafs] adafs_try_append_log "
-						"interrupted in waiting for flush_cmpl.\n");
+						"interrupted in waiting for flush.\n");
 				break;
 			}
 		}
-		rl_set_enti(rl, ei);
+		if (ei != L_NULL) {
+			struct rlog *srl = L_RLOG(log, ei);
+			srl->rl_pool = RL_SLOT;
+			move_rlog(page_rlog, rl, srl, ei);
+			adafs_ispan_add(log, host, ei);
+		} else {
+			rl_set_enti(rl, ei);
+		}
 
 		on_write_new_page(log, copied);
 	}
 	return err;
 }
 
+/*
+ * Cuts pages [start, end] from range entry @ei. A range cut at its tail
+ * ends before @start, with a full last page, and one cut at its head
+ * refers to a page left. Caller holds l_fmutex.
+ */
+static inline void __truncate_range(struct adafs_log *log, unsigned int ei,
+		pgoff_t start, pgoff_t end)
+{
+	struct log_entry *le = L_ENT(log, ei);
+	pgoff_t first = le_pgi(le), last = le_last_pgi(le), k;
+	unsigned int len = le_len(le);
+
+	if (start > last || end < first)
+		return;
+	if (start <= first && end >= last) {
+		evict_range(log, ei);
+		le_set_inval(le);
+		start = first;
+		end = last;
+		goto stat;
+	}
+	if (start < first) start = first;
+	if (end > last) end = last;
+	for (k = end; k >= start && k > first; --k)
+		range_drop_page(log, ei, k - first);
+	if (start == first && range_drop_page(log, ei, 0)) {
+		le_set_inval(le); // no page left
+		start = first;
+		end = last;
+	} else if (end == last) {
+		spin_lock(&log->l_tlock);
+		le_set_nr_pages(le, start - first);
+		le_set_len(le, PAGE_CACHE_SIZE);
+		spin_unlock(&log->l_tlock);
+	}
+stat:
+	// Pages count one by one as they are written
+	for (k = start; k <= end; ++k)
+		on_evict_page(log, k == last ? len : PAGE_CACHE_SIZE);
+}
+
 // Put before truncate and free related pages
 static inline void adafs_truncate_hook(struct inode *inode,
 		loff_t lstart, loff_t lend)
 {
 	struct adafs_log *log = adafs_logs[(long)inode->i_private];
-	unsigned int i;
+	unsigned int i, first, last;
 	pgoff_t start, end;
 	struct log_entry *le;
 
@@ -184,38 +438,135 @@ static inline void adafs_truncate_hook(struct inode *inode,
 	end = (lend >> PAGE_CACHE_SHIFT);
 
 	mutex_lock(&log->l_fmutex);
-	for (i = log->l_end - 1;
-			seq_ng(log->l_begin, i); --i) {
+	// Only the span of this inode's entries that is not flushed yet
+	if (adafs_ispan_get(log, inode, &first, &last) ||
+			seq_less(last, log->l_begin)) {
+		mutex_unlock(&log->l_fmutex);
+		return;
+	}
+	if (seq_less(first, log->l_begin)) first = log->l_begin;
+	for (i = last; seq_ng(first, i); --i) {
 		le = L_ENT(log, i);
-		if (le_inval(le) || le_ino(le) != inode->i_ino)
+		if (!le_ready(log, i) || le_inval(le) || le_ino(le) != inode->i_ino)
 			continue;
 		if (le_meta(le)) {
+			// Stages fill out of order, so entries of this inode
+			// may precede its meta entry: keep scanning.
 			le_set_inval(le);
-			ADAFS_DEBUG(KERN_INFO "[adafs] adafs_truncate_hook() breaks at %u\n", i);
-			break;
+			continue;
 		}
-		if (le_pgi(le) >= start && le_pgi(le) <= end) {
+		if (le_range(le)) {
+			__truncate_range(log, i, start, end);
+		} else if (le_pgi(le) >= start && le_pgi(le) <= end) {
 			le_set_inval(le);
-			evict_entry(le, page_rlog);
+			evict_entry(log, le, page_rlog);
 			on_evict_page(log, le_len(le));
 		}
 	}
 	mutex_unlock(&log->l_fmutex);
 }
 
+/*
+ * Logs a page about to be stored to through a shared mapping, as write()
+ * does with adafs_try_assoc_rlog() and adafs_try_append_log(), so that a
+ * page with a sealed entry is copied before the store lands. The entry
+ * covers the page up to i_size. The page is locked only to be associated,
+ * so that a writer waiting for slots holds no page the flusher may lock.
+ * Put before the page is locked, with truncates held off. The mapping is
+ * write-protected again when the entry is sealed, by log_mkclean(), and
+ * when it is flushed.
+ * Returns -ENOMEM if the page cannot be logged, to fail the fault.
+ */
+static inline int adafs_page_mkwrite_hook(struct inode *inode,
+		struct page *page, loff_t size)
+{
+	struct rlog *rl;
+	unsigned long len;
+
+	if (!adafs_inode_logged(inode))
+		return 0;
+	if (page->index == size >> PAGE_CACHE_SHIFT)
+		len = size & ~PAGE_CACHE_MASK;
+	else
+		len = PAGE_CACHE_SIZE;
+
+	lock_page(page);
+	if (page->mapping != inode->i_mapping) {
+		unlock_page(page);
+		return 0;
+	}
+	rl = adafs_try_assoc_rlog(inode, page);
+	unlock_page(page);
+	if (unlikely(!rl))
+		return -ENOMEM;
+
+	adafs_try_append_log(inode, rl, 0, len);
+	adafs_balance_log(inode);
+	return 0;
+}
+
+/*
+ * Makes the pages of a file durable on fsync, opted in per file by the
+ * sync attribute (chattr +S) or O_SYNC, or per mount by -o sync. Entries
+ * still in the open transaction are sealed first, so later writes to
+ * their pages are copied rather than written under the flush. Other
+ * files keep fsync as a no-op.
+ */
+static inline int adafs_fsync_hook(struct file *file)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct adafs_log *log = adafs_logs[(long)inode->i_private];
+	unsigned int first, last;
+
+	if (!IS_SYNC(inode) && !(file->f_flags & O_DSYNC))
+		return 0;
+	if (adafs_ispan_get(log, inode, &first, &last) ||
+			seq_less(last, ACCESS_ONCE(log->l_begin)))
+		return 0;
+	if (!seq_less(last, ACCESS_ONCE(log->l_head)))
+		log_seal(log);
+	return log_sync_inode(log, inode, first, last);
+}
+
 // Put before freeing in-mapping pages
 static inline void adafs_evict_inode_hook(struct inode *inode)
 {
 	ADAFS_DEBUG(KERN_INFO "[adafs] adafs_evict_inode_hook() for ino=%lu\n", inode->i_ino);
 
 	adafs_truncate_hook(inode, 0, (loff_t)-1);
+	ispan_del(inode_span, inode);
+}
+
+/*
+ * Binds @inode to the log of @dir. Only an inode without pages, hence
+ * without entries or rlogs in its old log, can follow, as truncate and
+ * evict scan the log it is bound to. Others stay until they are flushed
+ * and dropped from the page cache.
+ */
+static inline int __adafs_follow_dir(struct inode *dir, struct inode *inode)
+{
+	if (inode->i_private == dir->i_private || inode->i_mapping->nrpages)
+		return 0;
+	ispan_del(inode_span, inode); // of the old log
+	inode->i_private = dir->i_private;
+	return 1;
+}
+
+// Put after the inode is read in by lookup
+static inline void adafs_lookup_hook(struct inode *dir, struct inode *inode)
+{
+	if (inode && !IS_ERR(inode) && __adafs_follow_dir(dir, inode)) {
+		ADAFS_DEBUG(KERN_INFO "[adafs] lookup_hook(): %lu to log(%lu)\n",
+				inode->i_ino, (unsigned long)dir->i_private);
+	}
 }
 
 static inline void adafs_rename_hook(struct inode *new_dir, struct inode *old_inode)
 {
-	old_inode->i_private = new_dir->i_private;
-	ADAFS_DEBUG(KERN_INFO "[adafs] rename_hook(): %lu->%lu to %lu\n",
-			new_dir->i_ino, (unsigned long)new_dir->i_private, old_inode->i_ino);
+	if (__adafs_follow_dir(new_dir, old_inode)) {
+		ADAFS_DEBUG(KERN_INFO "[adafs] rename_hook(): %lu->%lu to %lu\n",
+				new_dir->i_ino, (unsigned long)new_dir->i_private, old_inode->i_ino);
+	}
 }
 
 /* Replacements */
@@ -237,7 +588,7 @@ static inline int adafs_writepage_cut(struct page *page,
 {
 	struct inode *inode = page->mapping->host;
 	int ret = 0;
-	if (S_ISREG(inode->i_mode)) {
+	if (adafs_inode_logged(inode)) {
 		/* Set the page dirty again, unlock */
 		redirty_page_for_writepage(wbc, page);
 		unlock_page(page);
@@ -246,9 +597,9 @@ static inline int adafs_writepage_cut(struct page *page,
 	return ret;
 }
 
-#define adafs_writepages_cut(inode) (S_ISREG((inode)->i_mode))
+#define adafs_writepages_cut(inode) adafs_inode_logged(inode)
 
-#define adafs_sync_file_cut(inode) (S_ISREG((inode)->i_mode) ? \
-		printk(KERN_INFO "[adafs] adafs_sync_file_cut at %s\n", __func__), 1 : 0)
+/* The containing function returns adafs_fsync_hook() instead */
+#define adafs_sync_file_cut(inode) adafs_inode_logged(inode)
 
 #endif /* ADAFS_H_ */
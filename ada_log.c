@@ -15,13 +15,16 @@
 #include <linux/pagemap.h>
 #include <linux/blkdev.h>
 #include <linux/writeback.h>
+#include <linux/rmap.h>
+#include <linux/hash.h>
+#include <linux/math64.h>
 #endif
 #include "ada_log.h"
 
 #define CUT_OFF 4
 #define STACK_SIZE 32
 
-#define entry(i) (entries[(i) & LOG_MASK])
+#define entry(i) (*L_ENT(log, i))
 
 #define SWAP_ENTRY(a, b) do { \
         struct log_entry tmp; \
@@ -35,6 +38,10 @@
 
 #ifdef __KERNEL__
 struct kmem_cache *adafs_tran_cachep;
+#else
+atomic_t __ucpu_count = ATOMIC_INIT(0);
+__thread int __ucpu_id = -1;
+struct __ucpu_region __ucpu_regions[NR_CPUS];
 #endif
 
 struct stack_elem {
@@ -42,9 +49,6 @@ struct stack_elem {
     unsigned int right;
 };
 
-static struct stack_elem stack[STACK_SIZE];
-static unsigned int stack_top = 0;
-
 #define elem_len(elem) (elem.right - elem.left + 1)
 #define stack_empty() (stack_top == 0)
 #define stack_avail(nr) (STACK_SIZE - stack_top >= nr)
@@ -56,7 +60,7 @@ static unsigned int stack_top = 0;
 #define stack_pop(elem) do { elem = stack[--stack_top]; } while(0)
 
 
-static void short_sort(struct log_entry entries[], int l, int r) {
+static void short_sort(struct adafs_log *log, int l, int r) {
   int i, max, pos;
   if (l >= r) return;
 
@@ -69,7 +73,7 @@ static void short_sort(struct log_entry entries[], int l, int r) {
   }
 }
 
-static inline unsigned int partition(struct log_entry entries[], int l, int r) {
+static inline unsigned int partition(struct adafs_log *log, int l, int r) {
     int mi = (l + r) >> 1;
     struct log_entry m = entry(mi);
     entry(mi) = entry(l);
@@ -84,29 +88,182 @@ static inline unsigned int partition(struct log_entry entries[], int l, int r) {
     return l;
 }
 
-int __log_sort(struct adafs_log *log, unsigned int begin, unsigned int end) {
-    struct stack_elem elem;
+int __log_qsort(struct adafs_log *log, unsigned int begin, unsigned int end) {
+    struct stack_elem stack[STACK_SIZE], elem;
+    unsigned int stack_top = 0;
     int p;
     if (begin > end) {
-        begin -= LOG_LEN;
-        end -= LOG_LEN;
+        begin -= LOG_MAX_LEN;
+        end -= LOG_MAX_LEN;
     }
     stack_push(begin, end - 1);
     while (!stack_empty()) {
         stack_pop(elem);
         if (elem_len(elem) > CUT_OFF) {
-            p = partition(log->l_entries, elem.left, elem.right);
+            p = partition(log, elem.left, elem.right);
             if (!stack_avail(2)) return -EOVERFLOW;
-            stack_push(elem.left, p - 1);
-            stack_push(p + 1, elem.right);
+            // Smaller part on top bounds the depth by log2(LOG_MAX_LEN)
+            if (p - (int)elem.left > (int)elem.right - p) {
+                stack_push(elem.left, p - 1);
+                stack_push(p + 1, elem.right);
+            } else {
+                stack_push(p + 1, elem.right);
+                stack_push(elem.left, p - 1);
+            }
         } else {
-            short_sort(log->l_entries, elem.left, elem.right);
+            short_sort(log, elem.left, elem.right);
+        }
+    }
+    return 0;
+}
+
+#define RADIX_MASK (RADIX_SIZE - 1)
+#define radix_digit(key, p) ((unsigned int)((key) >> ((p) * RADIX_BITS)) & RADIX_MASK)
+
+/*
+ * LSD radix sort of the sequence numbers in the slice of sorter buffers
+ * described by @sp, by le_key(). Entries stay in place. Being stable, it
+ * keeps equal keys in log order. Passes in which all keys share a digit
+ * are skipped, which is the common case for high bits of inode numbers.
+ * Returns the buffer slice holding the result.
+ */
+static unsigned int *__radix_sort(struct adafs_log *log, struct sort_part *sp) {
+    struct log_sorter *so = &log->l_sorter;
+    u64 *keys = so->keys + sp->off, *tkeys = so->tkeys + sp->off, *kp;
+    unsigned int *idx = so->idx + sp->off, *tidx = so->tidx + sp->off, *ip;
+    unsigned int n = sp->n;
+    unsigned int i, p, d, c, sum;
+    u64 key;
+
+    memset(sp->count, 0, sizeof(sp->count));
+    for (i = 0; i < n; ++i) {
+        key = le_key(L_ENT(log, idx[i]));
+        keys[i] = key;
+        for (p = 0; p < RADIX_PASSES; ++p) {
+            ++sp->count[p][radix_digit(key, p)];
+        }
+    }
+
+    for (p = 0; p < RADIX_PASSES && n; ++p) {
+        unsigned int *count = sp->count[p];
+        if (count[radix_digit(keys[0], p)] == n) continue;
+
+        for (d = 0, sum = 0; d < RADIX_SIZE; ++d) {
+            c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; ++i) {
+            c = count[radix_digit(keys[i], p)]++;
+            tkeys[c] = keys[i];
+            tidx[c] = idx[i];
         }
+        kp = keys; keys = tkeys; tkeys = kp;
+        ip = idx; idx = tidx; tidx = ip;
     }
+    return idx;
+}
+
+/*
+ * Sorts sequence numbers in [begin, end) on the calling thread, leaving
+ * the result in sorter->sorted. Caller holds l_somutex.
+ */
+int __log_sort(struct adafs_log *log, unsigned int begin, unsigned int end) {
+    struct log_sorter *so = &log->l_sorter;
+    struct sort_part *sp = so->parts;
+    unsigned int i;
+
+    sp->off = 0;
+    sp->n = seq_dist(begin, end);
+    if (__log_sorter_fit(so, sp->n)) return -ENOMEM;
+    for (i = 0; i < sp->n; ++i) {
+        so->idx[i] = begin + i;
+    }
+    so->sorted = __radix_sort(log, sp);
     return 0;
 }
 
-struct flush_operations flush_ops = { NULL, NULL, NULL };
+/* Sorts one part and stores it as a run starting at sp->pos */
+void sort_part_work(struct work_struct *work) {
+    struct sort_part *sp = container_of(work, struct sort_part, work);
+    struct adafs_log *log = sp->log;
+    unsigned int *sorted = __radix_sort(log, sp);
+    unsigned int i;
+
+    for (i = 0; i < sp->n; ++i) {
+        *L_RUN(log, sp->pos + i) = sorted[i];
+    }
+}
+
+#define ino_part(ino, nr) (hash_32((u32)(ino), 16) % (nr))
+
+/*
+ * Sorts [begin, end) into runs that lie back to back in l_runs, and
+ * returns the number of runs, with their ends relative to @begin in
+ * @run_ends. A large transaction is partitioned by inode hash, so that
+ * the parts, sorted on separate workers, share no page and can simply be
+ * merged as separate runs. Caller holds l_somutex.
+ */
+static unsigned int __log_sort_tran(struct adafs_log *log,
+        unsigned int begin, unsigned int end, unsigned int *run_ends) {
+    struct log_sorter *so = &log->l_sorter;
+    struct sort_part *sp;
+    unsigned int n = seq_dist(begin, end);
+    unsigned int nr = min_t(unsigned int, ACCESS_ONCE(log->l_sort_parts),
+            num_online_cpus());
+    unsigned int i, p, off, nr_runs = 0;
+
+    if (n < LOG_PSORT_MIN || nr <= 1) nr = 1;
+    if (nr > LOG_SORT_PARTS) nr = LOG_SORT_PARTS;
+
+    for (p = 0; p < nr; ++p) {
+        so->parts[p].n = 0;
+    }
+    if (nr == 1) {
+        so->parts[0].n = n;
+        for (i = 0; i < n; ++i) {
+            so->idx[i] = begin + i;
+        }
+    } else {
+        // Parts are kept in tidx, as an entry may be invalidated meanwhile
+        for (i = 0; i < n; ++i) {
+            p = ino_part(le_ino(L_ENT(log, begin + i)), nr);
+            so->tidx[i] = p;
+            ++so->parts[p].n;
+        }
+        for (p = 0, off = 0; p < nr; ++p) {
+            so->parts[p].off = off;
+            off += so->parts[p].n;
+            so->parts[p].n = 0;
+        }
+        for (i = 0; i < n; ++i) {
+            sp = so->parts + so->tidx[i];
+            so->idx[sp->off + sp->n++] = begin + i;
+        }
+    }
+
+    for (p = 0, off = 0; p < nr; ++p) {
+        sp = so->parts + p;
+        sp->off = off;
+        sp->pos = begin + off;
+        off += sp->n;
+        if (sp->n) run_ends[nr_runs++] = off;
+        if (p && sp->n) queue_work(system_unbound_wq, &sp->work);
+    }
+    sort_part_work(&so->parts[0].work);
+    for (p = 1; p < nr; ++p) {
+        if (so->parts[p].n) flush_work(&so->parts[p].work);
+    }
+    return nr_runs;
+}
+
+static void __log_cmpl_queue(struct adafs_log *log, const struct flush_group *fg);
+static unsigned int __merge_emit(struct adafs_log *log, unsigned int *out,
+		unsigned int n, unsigned int *ld, unsigned int *lr, unsigned int seq);
+
+#ifdef __KERNEL__
+
+struct flush_operations flush_ops = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
 
 static inline handle_t *do_trans_begin(struct inode *inode, int nles) {
 	if (likely(nles > 0 && flush_ops.trans_begin)) {
@@ -115,6 +272,16 @@ static inline handle_t *do_trans_begin(struct inode *inode, int nles) {
 	return NULL;
 }
 
+/*
+ * Write-protects a locked page mapped shared, as clear_page_dirty_for_io()
+ * does before writeback, so that the next store through a mapping faults
+ * into adafs_page_mkwrite_hook() and is logged again.
+ */
+static inline void __le_page_mkclean(struct page *page) {
+	if (page_mapped(page))
+		page_mkclean(page);
+}
+
 /* Adopted from write_cache_pages() in mm/page-writeback.c */
 static inline int do_le_flush(handle_t *handle,
 		struct log_entry *le, struct writeback_control *wbc) {
@@ -134,6 +301,7 @@ static inline int do_le_flush(handle_t *handle,
 		//}
 
 		BUG_ON(PageWriteback(page));
+		__le_page_mkclean(page);
 		//if (!clear_page_dirty_for_io(page))
 			//goto out;
 
@@ -145,6 +313,34 @@ static inline int do_le_flush(handle_t *handle,
 	return 0;
 }
 
+/*
+ * Flushes entries of @nr consecutive pages of one file, locked in index
+ * order, with one call to entry_flush_range if the file system has it.
+ * On failure, all of them are taken as failed.
+ */
+static inline int do_le_flush_range(handle_t *handle,
+		struct log_entry **les, unsigned int nr,
+		struct writeback_control *wbc) {
+	unsigned int i;
+	int err = 0, ret;
+
+	if (nr == 1 || !handle || !flush_ops.entry_flush_range) {
+		for (i = 0; i < nr; ++i) {
+			ret = do_le_flush(handle, les[i], wbc);
+			if (unlikely(ret)) err = ret;
+		}
+		return err;
+	}
+	for (i = 0; i < nr; ++i) {
+		ADAFS_DEBUG(KERN_INFO "[adafs] do_le_flush_range() flushes page: "
+				LE_DUMP_PAGE(les[i]));
+		lock_page(le_page(les[i]));
+		BUG_ON(PageWriteback(le_page(les[i])));
+		__le_page_mkclean(le_page(les[i]));
+	}
+	return flush_ops.entry_flush_range(handle, les, nr, wbc);
+}
+
 static inline int __do_wait_sync(struct inode *inode, tid_t tid)
 {
 	if (likely(flush_ops.wait_sync)) {
@@ -153,6 +349,34 @@ static inline int __do_wait_sync(struct inode *inode, tid_t tid)
 	return 0;
 }
 
+static inline int __do_wait_io(struct inode *inode)
+{
+	if (likely(flush_ops.wait_io)) {
+		return flush_ops.wait_io(inode);
+	}
+	return 0;
+}
+
+static inline int __do_wait_commit(struct inode *inode, tid_t tid)
+{
+	if (likely(flush_ops.wait_commit)) {
+		return flush_ops.wait_commit(inode, tid);
+	}
+	return 0;
+}
+
+static inline int do_trans_max(struct inode *inode) {
+	if (flush_ops.trans_max) {
+		return flush_ops.trans_max(inode);
+	}
+	return INT_MAX;
+}
+
+static inline int do_group_commit(struct adafs_log *log) {
+	return ACCESS_ONCE(log->l_group_commit) &&
+			flush_ops.wait_io && flush_ops.wait_commit;
+}
+
 static inline int do_trans_end(handle_t *handle) {
 	if (likely(handle && flush_ops.trans_end)) {
 		return flush_ops.trans_end(handle);
@@ -160,125 +384,743 @@ static inline int do_trans_end(handle_t *handle) {
 	return 0;
 }
 
-#define le_for_each(le, i, begin, end) \
-		for (le = &entry(i = (begin)); seq_less(i, end); le = &entry(++i))
+#define le_at(k) L_ENT(log, idx[k])
 
-static int __merge_flush(struct adafs_log *log,
-		const unsigned int begin, const unsigned int end) {
-	struct log_entry *entries = log->l_entries;
+/*
+ * Flushes the pages left of range entry @ei as runs of consecutive pages,
+ * each page as an entry of its own on the stack, so that file systems see
+ * the entries they know. A COW copy stands for its page.
+ */
+static int __range_flush(struct adafs_log *log, handle_t *handle,
+		unsigned int ei, struct writeback_control *wbc) {
+	struct log_entry *le = L_ENT(log, ei);
+	struct address_space *mapping = le_page(le)->mapping;
+	struct log_entry ents[LOG_FLUSH_RANGE], *les[LOG_FLUSH_RANGE];
+	unsigned int k, n = le_nr_pages(le), nr = 0;
+	struct rlog *rl;
+	int copy, err = 0, ret;
+
+	for (k = 0; k <= n; ++k) {
+		rl = k < n ? __range_rlog(log, ei, mapping, k, &copy) : NULL;
+		if (rl) {
+			ents[nr] = *le;
+			ents[nr].le_pgi = le_pgi(le) + k;
+			le_set_nr_pages(&ents[nr], 1);
+			if (k != n - 1) le_set_len(&ents[nr], PAGE_CACHE_SIZE);
+			le_set_ref(&ents[nr], rl_page(rl));
+			les[nr] = ents + nr;
+			++nr;
+		}
+		if (nr && (!rl || nr == LOG_FLUSH_RANGE)) {
+			ret = do_le_flush_range(handle, les, nr, wbc);
+			if (unlikely(ret)) err = ret;
+			nr = 0;
+		}
+	}
+	return err;
+}
+
+/* Pages of the data entries idx[b, e), which take journal credits */
+static unsigned int __group_pages(struct adafs_log *log,
+		const unsigned int *idx, unsigned int b, unsigned int e) {
 	struct log_entry *le;
-	struct inode *inode;
+	unsigned int nr = 0;
+
+	for (; b < e; ++b) {
+		le = le_at(b);
+		if (le_valid(le) && !le_meta(le)) nr += le_nr_pages(le);
+	}
+	return nr;
+}
+
+/* Submits the entries of group @fg in one handle, stage 2 of a flush */
+static int __group_submit(struct adafs_log *log, struct flush_group *fg) {
+	const unsigned int *idx = fg->idx;
+	struct log_entry *le, *les[LOG_FLUSH_RANGE];
+	struct blk_plug plug;
 	handle_t *handle;
-	tid_t commit_tid;
-	unsigned int b, e, i, nles;
-	int err = 0;
+	unsigned int i, j, k, nr;
+	int err = 0, ret;
+	struct writeback_control wbc = {
+			.sync_mode = WB_SYNC_ALL,
+			.nr_to_write = LONG_MAX,
+			.range_start = 0,
+			.range_end = LLONG_MAX };
+
+	blk_start_plug(&plug);
+	handle = do_trans_begin(fg->inode, __group_pages(log, idx, fg->b, fg->e));
+	ADAFS_BUG_ON(IS_ERR(handle));
+	fg->commit_tid = handle->h_transaction->t_tid;
+
+	for (i = fg->b; i < fg->e; i = j) {
+		le = le_at(i);
+		j = i + 1;
+		if (le_inval(le) || le_meta(le)) continue;
+
+		if (le_range(le)) {
+			ret = __range_flush(log, handle, idx[i], &wbc);
+			if (unlikely(ret)) {
+				PRINT(ERR "[adafs] entry_flush failed: %d\n", ret);
+				PRINT(ERR "[adafs] entry_flush failed: " LE_DUMP(le));
+				evict_range(log, idx[i]);
+				le_set_inval(le);
+				err = ret;
+			}
+			continue;
+		}
+
+		// Consecutive pages of one file are written as an extent
+		les[0] = le;
+		for (nr = 1; j < fg->e && nr < LOG_FLUSH_RANGE; ++j, ++nr) {
+			le = le_at(j);
+			if (le_inval(le) || le_meta(le) || le_range(le) ||
+					le_page(le)->mapping != le_page(les[0])->mapping ||
+					le_pgi(le) != le_pgi(les[nr - 1]) + 1) break;
+			les[nr] = le;
+		}
+
+		ret = do_le_flush_range(handle, les, nr, &wbc);
+		if (unlikely(ret)) {
+			PRINT(ERR "[adafs] entry_flush failed: %d\n", ret);
+			for (k = 0; k < nr; ++k) {
+				PRINT(ERR "[adafs] entry_flush failed: " LE_DUMP(les[k]));
+				le_set_inval(les[k]);
+				evict_entry(log, les[k], page_rlog);
+			}
+			err = ret;
+		}
+	}
+	ret = do_trans_end(handle);
+	blk_finish_plug(&plug);
+	return ret ? ret : err;
+}
+
+/* Waits for the commit that covers all groups completed so far */
+static void __commit_wait(struct adafs_log *log, struct flush_commit *fc) {
+	int err;
+
+	if (!fc->nr_groups) return;
+	err = __do_wait_commit(fc->inode, fc->tid);
+	if (unlikely(err)) {
+		PRINT(ERR "[adafs] wait_commit failed: %d, tid=%u, groups=%u\n",
+				err, fc->tid, fc->nr_groups);
+	}
+	++log->l_commits;
+	fc->nr_groups = 0;
+}
+
+/*
+ * Waits for the writeback of group @fg and evicts its entries, stage 3 of
+ * a flush. The commit of its handle is waited for here, or deferred to
+ * __commit_wait() in group commit.
+ */
+static void __group_complete(struct adafs_log *log, struct flush_group *fg,
+		struct flush_commit *fc) {
+	const unsigned int *idx = fg->idx;
+	struct log_entry *le;
+	struct inode *inode = NULL, *host;
+	unsigned int i;
+
+	if (!fg->group_commit) {
+		for (i = fg->b; i < fg->e; ++i) {
+			le = le_at(i);
+			if (le_inval(le) || le_meta(le)) continue;
+			if (le_range(le)) {
+				log->l_flushed += evict_range(log, idx[i]);
+				continue;
+			}
+			wait_on_page_writeback(le_page(le));
+			evict_entry(log, le, page_rlog);
+			++log->l_flushed;
+		}
+
+		if (!fg->i_locked) mutex_lock(&fg->inode->i_mutex);
+		__do_wait_sync(fg->inode, fg->commit_tid);
+		if (!fg->i_locked) mutex_unlock(&fg->inode->i_mutex);
+		++log->l_commits;
+		return;
+	}
+
+	// Completes I/O of each inode once all its pages are written back
+	for (i = fg->b; i <= fg->e; ++i) {
+		le = i < fg->e ? le_at(i) : NULL;
+		if (le && (le_inval(le) || le_meta(le))) continue;
+		host = le ? le_page(le)->mapping->host : NULL;
+		if (host != inode && inode) {
+			mutex_lock(&inode->i_mutex);
+			__do_wait_io(inode);
+			mutex_unlock(&inode->i_mutex);
+		}
+		if (!le) break;
+		inode = host;
+		if (le_range(le)) {
+			log->l_flushed += evict_range(log, idx[i]);
+			continue;
+		}
+		wait_on_page_writeback(le_page(le));
+		evict_entry(log, le, page_rlog);
+		++log->l_flushed;
+	}
+
+	if (fc->nr_groups && fc->inode->i_sb != fg->inode->i_sb)
+		__commit_wait(log, fc);
+	fc->inode = fg->inode;
+	fc->tid = fg->commit_tid; // of the latest handle, covering earlier ones
+	++fc->nr_groups;
+}
+
+/*
+ * Flushes entries in the order of sequence numbers idx[0, n), a group of
+ * one handle at a time. In group commit, a group spans inodes of one file
+ * system as far as journal credits allow; otherwise it holds one inode.
+ * Groups are queued for completion once submitted, so the bios of a group
+ * are in flight while the next is prepared.
+ */
+static int __merge_flush(struct adafs_log *log,
+		const unsigned int *idx, const unsigned int n) {
+	struct flush_group cur;
+	struct log_entry *le;
+	struct super_block *sb;
+	unsigned int b, e, i, limit, pages;
+	int err = 0, ret;
+	int group_commit = do_group_commit(log);
 	unsigned long ino;
 
-	for (b = begin; seq_less(b, end); b = e) {
-		le = &entry(b);
+	for (b = 0; b < n; b = e) {
+		le = le_at(b);
 		if (unlikely(le_inval(le))) {
 			break;
 		} else if (le_meta(le)) {
 			e = b + 1;
-		} else { // to flush a group of entries
-			struct blk_plug plug;
-			struct writeback_control wbc = {
-					.sync_mode = WB_SYNC_ALL,
-					.nr_to_write = LONG_MAX,
-					.range_start = 0,
-					.range_end = LLONG_MAX };
-
-			le = &entry(b);
-			ino = le_ino(le);
-			ADAFS_DEBUG(KERN_DEBUG "[adafs-debug] __merge_flush() gets sb from page: "
-					LE_DUMP_PAGE(le));
-			inode = le_page(le)->mapping->host;
-
-			nles = 1; // counts pages to flush
-			le_for_each(le, i, b + 1, end) {
-				if (unlikely(le_ino(le) != ino)) break;
-				if (le_pgi(&entry(i - 1)) == le_pgi(le)) {
-					ADAFS_DEBUG(INFO "[adafs] __merge_flush() invalidates entry: "
-							LE_DUMP(&entry(i - 1)));
-					le_set_inval(&entry(i - 1));
-					evict_entry(&entry(i - 1), page_rlog);
-
-					if (le_len(le) < le_len(&entry(i - 1)))
-						le_set_len(le, le_len(&entry(i - 1)));
-				} else {
-					++nles;
-				}
-			} // for
-			e = i;
-			PRINT("[adafs] __merge_flush() begins flushing: ino=%lu "
-					"begin=%u, end=%u, num=%u\n", ino, b, e, nles);
-
-			blk_start_plug(&plug);
-			handle = do_trans_begin(inode, nles);
-			ADAFS_BUG_ON(IS_ERR(handle));
-			commit_tid = handle->h_transaction->t_tid;
-
-			le_for_each(le, i, b, e) {
-				if (le_inval(le)) continue;
-				err = do_le_flush(handle, le, &wbc);
-				if (unlikely(err)) {
-					PRINT(ERR "[adafs] entry_flush failed: %d\n", err);
-					PRINT(ERR "[adafs] entry_flush failed: " LE_DUMP(le));
-					le_set_inval(le);
-					evict_entry(le, page_rlog);
-				}
-			}
-			err = do_trans_end(handle);
-			blk_finish_plug(&plug);
+			continue;
+		}
 
-			le_for_each(le, i, b, e) {
-				if (le_inval(le)) continue;
-				wait_on_page_writeback(le_page(le));
-				evict_entry(le, page_rlog);
+		// To flush a group of entries
+		ADAFS_DEBUG(KERN_DEBUG "[adafs-debug] __merge_flush() gets sb from page: "
+				LE_DUMP_PAGE(le));
+		cur.inode = le_page(le)->mapping->host;
+		sb = cur.inode->i_sb;
+		limit = group_commit ? max_t(int, do_trans_max(cur.inode), 1) : UINT_MAX;
+		ino = le_ino(le);
+		pages = le_nr_pages(le);
+
+		// Pages are unique after __log_merge(), and limited as credits
+		for (i = b + 1; i < n; ++i) {
+			le = le_at(i);
+			if (unlikely(le_inval(le))) break;
+			if (le_meta(le)) {
+				if (group_commit) continue;
+				break;
 			}
+			if (pages + le_nr_pages(le) > limit) break;
+			pages += le_nr_pages(le);
+			if (le_ino(le) == ino) continue;
+			if (!group_commit || le_page(le)->mapping->host->i_sb != sb)
+				break;
+			ino = le_ino(le);
+		}
+		e = i;
+		PRINT("[adafs] __merge_flush() begins flushing: ino=%lu "
+				"begin=%u, end=%u, num=%u\n",
+				cur.inode->i_ino, b, e, e - b);
 
-			log->l_begin = e;
+		cur.idx = idx;
+		cur.b = b;
+		cur.e = e;
+		cur.group_commit = group_commit;
+		cur.i_locked = 0;
+		ret = __group_submit(log, &cur);
+		if (unlikely(ret)) err = ret;
+		__log_cmpl_queue(log, &cur);
+	} // for all target entries
+	return err;
+}
 
-			mutex_lock(&inode->i_mutex);
-			__do_wait_sync(inode, commit_tid);
-			mutex_unlock(&inode->i_mutex);
+static inline void __merge_drop(struct adafs_log *log, struct log_entry *le) {
+	ADAFS_DEBUG(INFO "[adafs] __log_merge() invalidates entry: " LE_DUMP(le));
+	le_set_inval(le);
+	evict_entry(log, le, page_rlog);
+}
+
+/* Returns nonzero if no page is left of range entry @seq */
+static inline int __merge_drop_page(struct adafs_log *log, unsigned int seq,
+		unsigned int k) {
+	ADAFS_DEBUG(INFO "[adafs] __log_merge() drops page %u of entry: "
+			LE_DUMP(L_ENT(log, seq)), k);
+	return range_drop_page(log, seq, k);
+}
+
+/*
+ * Flushes the sealed entries of @inode in [first, last] for a durable
+ * fsync, in handles of the inode alone, and returns after their commit.
+ * Pages collapse into their latest entries as in __log_merge(). The
+ * entries are then invalidated, and the rest of their transactions is
+ * left to the flusher, so the cost follows the pages of the file.
+ * Caller holds i_mutex of @inode, as ->fsync is entered with it.
+ */
+int log_sync_inode(struct adafs_log *log, struct inode *inode,
+		unsigned int first, unsigned int last) {
+	struct log_sorter *so = &log->l_sorter;
+	struct log_merger *mg = &log->l_merger;
+	struct sort_part *sp = so->parts;
+	struct flush_commit fc = { 0 };
+	struct flush_group fg;
+	struct log_entry *le;
+	unsigned int *sorted, i, j, n = 0, k = 0, limit, pages;
+	unsigned int ld = L_NULL, lr = L_NULL;
+	int err = 0, ret;
+
+	mutex_lock(&log->l_fmutex);
+	// Flushed entries are committed before their slots are released
+	if (seq_less(first, log->l_begin)) first = log->l_begin;
+	if (!seq_less(last, ACCESS_ONCE(log->l_head)))
+		last = ACCESS_ONCE(log->l_head) - 1;
+	if (seq_less(last, first)) goto out;
+
+	mutex_lock(&log->l_somutex);
+	if (__log_sorter_fit(so, seq_dist(first, last) + 1) ||
+			__log_merger_fit(mg, seq_dist(first, last) + 1)) {
+		mutex_unlock(&log->l_somutex);
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = first; seq_ng(i, last); ++i) {
+		le = L_ENT(log, i);
+		if (!le_ready(log, i) || le_inval(le) || le_meta(le) ||
+				le_ino(le) != inode->i_ino)
+			continue;
+		so->idx[n++] = i;
+	}
+	sp->off = 0;
+	sp->n = n;
+	sorted = __radix_sort(log, sp);
+
+	// Pages collapse into their newer entries as in the flush
+	mg->out = mg->outs[0];
+	for (i = 0; i < n; ++i) {
+		k = __merge_emit(log, mg->out, k, &ld, &lr, sorted[i]);
+	}
+	mutex_unlock(&log->l_somutex);
+
+	fg.idx = mg->out;
+	fg.inode = inode;
+	fg.group_commit = 0;
+	fg.i_locked = 1; // ->fsync is entered with i_mutex held
+	limit = max_t(int, do_trans_max(inode), 1);
+	for (fg.b = 0; fg.b < k; fg.b = fg.e) {
+		pages = le_nr_pages(L_ENT(log, fg.idx[fg.b]));
+		for (fg.e = fg.b + 1; fg.e < k; ++fg.e) {
+			le = L_ENT(log, fg.idx[fg.e]);
+			if (pages + le_nr_pages(le) > limit) break;
+			pages += le_nr_pages(le);
 		}
-	} // for all target entries
+		ret = __group_submit(log, &fg);
+		if (unlikely(ret)) err = ret;
+		__group_complete(log, &fg, &fc);
+		// Skipped by the merge when their transactions are flushed
+		for (j = fg.b; j < fg.e; ++j) {
+			le_set_inval(L_ENT(log, fg.idx[j]));
+		}
+	}
+	ADAFS_DEBUG(INFO "[adafs] log_sync_inode() flushed %u pages of ino=%lu: %d\n",
+			k, inode->i_ino, err);
+out:
+	mutex_unlock(&log->l_fmutex);
 	return err;
 }
 
+/*
+ * Write-protects mapped pages of entries [begin, end) just sealed, so that
+ * the next store through a mapping faults into adafs_page_mkwrite_hook()
+ * and copies the page instead of changing the sealed one. Pages are pinned
+ * and locked as a truncate may evict the entries meanwhile.
+ */
+void log_mkclean(struct adafs_log *log, unsigned int begin, unsigned int end) {
+	struct address_space *mapping;
+	struct log_entry *le;
+	struct page *page, *p;
+	unsigned int i, k, n;
+
+	for (i = begin; seq_less(i, end); ++i) {
+		le = L_ENT(log, i);
+		if (!le_ready(log, i) || le_inval(le) || le_meta(le)) continue;
+		page = le_page(le);
+		// Copies are never mapped and need no lock
+		if (!le_range(le) && !page_mapped(page)) continue;
+		if (!get_page_unless_zero(page)) continue;
+
+		lock_page(page);
+		mapping = page->mapping;
+		if (mapping && mapping_mapped(mapping)) {
+			__le_page_mkclean(page);
+			// Pages of a range are locked in index order as by the flusher
+			for (k = 1, n = le_nr_pages(le); k < n; ++k) {
+				p = find_lock_page(mapping, le_pgi(le) + k);
+				if (!p) continue;
+				__le_page_mkclean(p);
+				unlock_page(p);
+				put_page(p);
+			}
+		}
+		unlock_page(page);
+		put_page(page);
+	}
+}
+
+#else
+
+static void __commit_wait(struct adafs_log *log, struct flush_commit *fc) {
+	if (!fc->nr_groups) return;
+	++log->l_commits;
+	fc->nr_groups = 0;
+}
+
+static void __group_complete(struct adafs_log *log, struct flush_group *fg,
+		struct flush_commit *fc) {
+	unsigned int i;
+
+	for (i = fg->b; i < fg->e; ++i) {
+		log->l_flushed += le_nr_pages(L_ENT(log, fg->idx[i]));
+	}
+	++fc->nr_groups;
+}
+
+// Queues all entries as one group to follow the kernel pipeline
+static int __merge_flush(struct adafs_log *log,
+		const unsigned int *idx, const unsigned int n) {
+	struct flush_group fg = { idx, 0, n };
+
+	if (n) __log_cmpl_queue(log, &fg);
+	return 0;
+}
+
+#define __merge_drop(log, le)	le_set_inval(le)
+// Pages are not tracked without the page cache
+#define __merge_drop_page(log, seq, k)	0
+
+#endif
+
+/* Sorts sealed transactions into runs in order. Caller holds l_somutex. */
+static void __log_sort_runs(struct adafs_log *log) {
+    struct transaction *tran;
+    unsigned int run_ends[LOG_SORT_PARTS];
+    unsigned int begin = 0, end = 0, nr_runs;
+    int found;
+
+    for (;;) {
+        found = 0;
+        spin_lock(&log->l_tlock);
+        list_for_each_entry(tran, &log->l_trans, list) {
+            if (is_tran_open(tran)) break;
+            if (!tran->nr_runs) {
+                begin = tran->begin;
+                end = tran->end;
+                found = 1;
+                break;
+            }
+        }
+        spin_unlock(&log->l_tlock);
+        if (!found) break;
+        if (__log_sorter_fit(&log->l_sorter, seq_dist(begin, end))) {
+            PRINT(ERR "[adafs] __log_sort_runs() failed to grow buffers "
+                    "for %u entries\n", seq_dist(begin, end));
+            break; // retried by the next flush
+        }
+
+        // Only sorted transactions are flushed, so tran stays.
+        nr_runs = __log_sort_tran(log, begin, end, run_ends);
+
+        spin_lock(&log->l_tlock);
+        memcpy(tran->run_ends, run_ends, nr_runs * sizeof(unsigned int));
+        tran->nr_runs = nr_runs;
+        spin_unlock(&log->l_tlock);
+    }
+}
+
+void log_sort_work(struct work_struct *work) {
+    struct adafs_log *log = container_of(work, struct adafs_log, l_sort_work);
+
+    mutex_lock(&log->l_somutex);
+    __log_sort_runs(log);
+    mutex_unlock(&log->l_somutex);
+}
+
+#define run_done(mg, r) ((mg)->runs[r].r_next == (mg)->runs[r].r_end)
+
+/*
+ * Whether run @a beats run @b. Index @k is a virtual run that beats all
+ * when building the tree. Ties go to the older run.
+ */
+static inline int run_less(struct log_merger *mg, unsigned int k,
+        unsigned int a, unsigned int b) {
+    if (a == k) return 1;
+    if (b == k) return 0;
+    if (run_done(mg, a)) return 0;
+    if (run_done(mg, b)) return 1;
+    return mg->keys[a] < mg->keys[b] ||
+            (mg->keys[a] == mg->keys[b] && a < b);
+}
+
+/* Skips invalidated entries of run @r and caches the key of its head */
+static inline void run_settle(struct adafs_log *log, struct log_merger *mg,
+        unsigned int r) {
+    struct log_run *run = mg->runs + r;
+    struct log_entry *le;
+
+    for (; run->r_next != run->r_end; ++run->r_next) {
+        le = L_ENT(log, *L_RUN(log, run->r_next));
+        if (likely(le_valid(le))) {
+            mg->keys[r] = le_key(le);
+            break;
+        }
+    }
+}
+
+/* Replays run @r from its leaf up, leaving losers on the way */
+static inline void loser_adjust(struct log_merger *mg, unsigned int k,
+        unsigned int r) {
+    unsigned int t, tmp;
+
+    for (t = (r + k) >> 1; t > 0; t >>= 1) {
+        if (run_less(mg, k, mg->tree[t], r)) {
+            tmp = mg->tree[t];
+            mg->tree[t] = r;
+            r = tmp;
+        }
+    }
+    mg->tree[0] = r;
+}
+
+enum { MERGE_KEEP, MERGE_DROP, MERGE_TAKE };
+
+/*
+ * Resolves data entry @seq against out[o], merged before it, if the first
+ * page of @seq is within it. Entries of the same page collapse into the
+ * newer one, which inherits the larger length. A range only loses the
+ * page to a newer entry; pages within a newer range are bound to it
+ * rather than to older entries. Returns MERGE_KEEP to keep both,
+ * MERGE_DROP if @seq is dropped, or MERGE_TAKE if it takes over out[o].
+ */
+static inline int __merge_resolve(struct adafs_log *log, unsigned int *out,
+        unsigned int o, unsigned int seq) {
+    struct log_entry *prev = L_ENT(log, out[o]), *le = L_ENT(log, seq);
+    struct log_entry *keep, *drop;
+    unsigned int k, len;
+
+    if (!le_overlap(prev, le)) return MERGE_KEEP;
+    if (!le_range(prev) && !le_range(le)) {
+        if (seq_less(out[o], seq)) {
+            keep = le;
+            drop = prev;
+        } else {
+            keep = prev;
+            drop = le;
+        }
+        if (le_len(keep) < le_len(drop))
+            le_set_len(keep, le_len(drop));
+        __merge_drop(log, drop);
+        if (keep == prev) return MERGE_DROP;
+        out[o] = seq;
+        return MERGE_TAKE;
+    }
+    if (!seq_less(out[o], seq)) return MERGE_KEEP;
+    if (le_range(prev)) {
+        k = le_pgi(le) - le_pgi(prev);
+        len = k == le_nr_pages(prev) - 1 ? le_len(prev) : PAGE_CACHE_SIZE;
+        if (!le_range(le) && le_len(le) < len)
+            le_set_len(le, len);
+        if (!__merge_drop_page(log, out[o], k)) return MERGE_KEEP;
+        le_set_inval(prev); // no page left
+    } else {
+        __merge_drop(log, prev);
+    }
+    out[o] = seq;
+    return MERGE_TAKE;
+}
+
+/*
+ * Appends data entry @seq to out[0, n), unless it collapses into the last
+ * data entry out[*ld] or the last range out[*lr]. Only these can hold its
+ * first page, as ranges never overlap at later pages. Returns the new n.
+ */
+static unsigned int __merge_emit(struct adafs_log *log, unsigned int *out,
+        unsigned int n, unsigned int *ld, unsigned int *lr, unsigned int seq) {
+    unsigned int o = *ld;
+    int ret = MERGE_KEEP;
+
+    if (o != L_NULL) ret = __merge_resolve(log, out, o, seq);
+    if (ret == MERGE_KEEP && *lr != L_NULL && *lr != *ld) {
+        o = *lr;
+        ret = __merge_resolve(log, out, o, seq);
+    }
+    if (ret == MERGE_DROP) return n;
+    if (ret == MERGE_TAKE) {
+        if (o == *lr) *lr = L_NULL;
+        if (le_range(L_ENT(log, seq))) *lr = o;
+        return n;
+    }
+    if (le_range(L_ENT(log, seq))) *lr = n;
+    *ld = n;
+    out[n] = seq;
+    return n + 1;
+}
+
+/*
+ * Merges runs mg->runs[0, k) into mg->out with a loser tree, and returns
+ * the number of merged entries. Invalidated entries are skipped, and data
+ * entries are resolved by __merge_emit(). Caller holds l_fmutex.
+ */
+unsigned int __log_merge(struct adafs_log *log, unsigned int k) {
+    struct log_merger *mg = &log->l_merger;
+    struct log_entry *le;
+    unsigned int r, seq, n = 0;
+    unsigned int ld = L_NULL, lr = L_NULL; // last data entry and range
+
+    for (r = 0; r < k; ++r) {
+        mg->tree[r] = k;
+        run_settle(log, mg, r);
+    }
+    for (r = k; r-- > 0;) {
+        loser_adjust(mg, k, r);
+    }
+
+    for (r = mg->tree[0]; !run_done(mg, r); r = mg->tree[0]) {
+        seq = *L_RUN(log, mg->runs[r].r_next);
+        ++mg->runs[r].r_next;
+        run_settle(log, mg, r);
+        loser_adjust(mg, k, r);
+
+        le = L_ENT(log, seq);
+        if (le_meta(le)) {
+            mg->out[n++] = seq;
+            continue;
+        }
+        // A meta entry may come between data entries of page 0
+        n = __merge_emit(log, mg->out, n, &ld, &lr, seq);
+    }
+    return n;
+}
+
+/*
+ * Completes queued groups in order, releasing slots at the end of each
+ * round after one commit wait in group commit. Writers blocked on a full
+ * log are woken as slots are freed, before the whole flush ends.
+ */
+void log_cmpl_work(struct work_struct *work) {
+    struct adafs_log *log = container_of(work, struct adafs_log, l_cmpl_work);
+    struct flush_group *fg;
+
+    mutex_lock(&log->l_cmutex);
+    while (log->l_cq_head != ACCESS_ONCE(log->l_cq_tail)) {
+        smp_rmb();
+        fg = &log->l_cq[log->l_cq_head % LOG_CMPL_LEN];
+        if (fg->idx) {
+            __group_complete(log, fg, &log->l_fc);
+        } else {
+            __commit_wait(log, &log->l_fc);
+            // Lookups may still see rlogs evicted from the slots
+            synchronize_rcu();
+            __log_release(log, fg->e);
+            ACCESS_ONCE(log->l_rounds) = log->l_rounds + 1;
+        }
+        smp_mb();
+        ACCESS_ONCE(log->l_cq_head) = log->l_cq_head + 1;
+        wake_up_all(&log->l_wq);
+    }
+    mutex_unlock(&log->l_cmutex);
+}
+
+/* Queues group @fg for completion, waiting while the queue is full */
+static void __log_cmpl_queue(struct adafs_log *log, const struct flush_group *fg) {
+    unsigned int tail = log->l_cq_tail;
+
+    wait_event(log->l_wq,
+            seq_dist(ACCESS_ONCE(log->l_cq_head), tail) < LOG_CMPL_LEN);
+    log->l_cq[tail % LOG_CMPL_LEN] = *fg;
+    smp_wmb();
+    ACCESS_ONCE(log->l_cq_tail) = tail + 1;
+    queue_work(system_unbound_wq, &log->l_cmpl_work);
+}
+
+/*
+ * Flushes up to @nr sealed transactions, merging at most LOG_MERGE_WAYS
+ * of their runs at a time. Rounds are pipelined: groups are completed by
+ * l_cmpl_work while later ones are merged and submitted, and slots of a
+ * round are released once all its groups complete. Returns after all.
+ */
 int log_flush(struct adafs_log *log, unsigned int nr) {
-    unsigned int begin, end;
-    int err = 0;
+    struct log_merger *mg = &log->l_merger;
+    struct flush_group rel = { NULL };
     struct transaction *tran;
+    unsigned int head, end, k, i, n, rounds;
+    int err = 0, ret, flushed = 0;
+    u64 t;
+
+    // Catches up with the sort worker
+    mutex_lock(&log->l_somutex);
+    __log_sort_runs(log);
+    mutex_unlock(&log->l_somutex);
 
-    spin_lock(&log->l_tlock);
-    tran = list_first_entry(&log->l_trans, struct transaction, list);
-    begin = end = tran->begin;
+    mutex_lock(&log->l_fmutex);
+    // Transactions sealed later wait for the next flush
+    head = ACCESS_ONCE(log->l_head);
+    if (__log_merger_fit(mg, seq_dist(log->l_begin, head))) {
+        mutex_unlock(&log->l_fmutex);
+        PRINT(ERR "[adafs] log_flush() failed to grow buffers for %u entries\n",
+                seq_dist(log->l_begin, head));
+        return -ENOMEM;
+    }
+    t = adafs_now_ns();
+    rounds = log->l_rounds; // all completed by the last flush
     while (nr) {
-        if (is_tran_open(tran)) break;
-        ADAFS_BUG_ON(tran->begin != end);
-        end = tran->end;
-        list_del(&tran->list);
-        evict_tran(tran);
+        spin_lock(&log->l_tlock);
         tran = list_first_entry(&log->l_trans, struct transaction, list);
-        --nr;
+        end = tran->begin;
+        for (k = 0; nr; --nr) {
+            if (is_tran_open(tran) || !tran->nr_runs ||
+                    seq_less(head, tran->end) ||
+                    k + tran->nr_runs > LOG_MERGE_WAYS) break;
+            ADAFS_BUG_ON(tran->begin != end);
+            for (i = 0; i < tran->nr_runs; ++i, ++k) {
+                mg->runs[k].r_next = tran->begin + (i ? tran->run_ends[i - 1] : 0);
+                mg->runs[k].r_end = tran->begin + tran->run_ends[i];
+            }
+            end = tran->end;
+            atomic_long_sub(tran->stat.staleness, &log->l_stal_sum);
+            list_del(&tran->list);
+            evict_tran(tran);
+            tran = list_first_entry(&log->l_trans, struct transaction, list);
+        }
+        spin_unlock(&log->l_tlock);
+        if (!k) break;
+
+        // The round two back may still be completed from this buffer
+        wait_event(log->l_wq,
+                seq_dist(rounds, ACCESS_ONCE(log->l_rounds)) + 1 >= (unsigned int)flushed);
+        mg->out = mg->outs[flushed & 1];
+        n = __log_merge(log, k);
+        ret = __merge_flush(log, mg->out, n);
+        if (unlikely(ret)) err = ret;
+        rel.e = end;
+        __log_cmpl_queue(log, &rel);
+        ++flushed;
     }
-    spin_unlock(&log->l_tlock);
-    if (begin == end) {
-    	PRINT(WARNING "[adafs] No transaction flushed: l_begin=%u, l_head=%u, l_end=%u\n",
+    wait_event(log->l_wq,
+            seq_dist(rounds, ACCESS_ONCE(log->l_rounds)) == (unsigned int)flushed);
+    log->l_flush_ns += adafs_now_ns() - t;
+    mutex_unlock(&log->l_fmutex);
+
+    if (!flushed) {
+    	ADAFS_DEBUG(INFO "[adafs] No transaction flushed: l_begin=%u, l_head=%u, l_end=%u\n",
     			log->l_begin, log->l_head, log->l_end);
         return -ENODATA;
     }
-
-    mutex_lock(&log->l_fmutex);
-    __log_sort(log, begin, end);
-    err = __merge_flush(log, begin, end);
-    mutex_unlock(&log->l_fmutex);
     return err;
 }
 
 
+#ifdef __KERNEL__
+
 /* Attributes exported to sysfs */
 
 static ssize_t staleness_sum_show(struct adafs_log *log, char *buf)
@@ -294,15 +1136,13 @@ static ssize_t staleness_sum_store(struct adafs_log *log, const char *buf, size_
 	if (kstrtoul(buf, 0, &req_sum) || req_sum != 0)
 		return -EINVAL;
 
-	wake_up_process(adafs_flusher);
+	wake_up_process(log->l_flusher);
     return len;
 }
 
-unsigned int stal_limit_blocks = 4096;
-
 static ssize_t stal_limit_blocks_show(struct adafs_log *log, char *buf)
 {
-	return snprintf(buf, PAGE_SIZE, "%u\n", stal_limit_blocks);
+	return snprintf(buf, PAGE_SIZE, "%u\n", log->l_stal_limit_blocks);
 }
 
 static ssize_t stal_limit_blocks_store(struct adafs_log *log, const char *buf, size_t len)
@@ -312,16 +1152,262 @@ static ssize_t stal_limit_blocks_store(struct adafs_log *log, const char *buf, s
 	if (kstrtouint(buf, 0, &limit))
 		return -EINVAL;
 
-	stal_limit_blocks = limit;
+	// A fixed limit stops the locator
+	mutex_lock(&log->l_smutex);
+	log->l_loc.state = LOC_OFF;
+	log->l_stal_limit_blocks = limit;
+	mutex_unlock(&log->l_smutex);
+    return len;
+}
+
+// 0 if off, 1 while searching and 2 once found; writing 1 searches again
+static ssize_t loc_state_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", ACCESS_ONCE(log->l_loc.state));
+}
+
+static ssize_t loc_state_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val > LOC_SEARCH)
+		return -EINVAL;
+
+	mutex_lock(&log->l_smutex);
+	if (val == LOC_SEARCH) {
+		loc_reset(&log->l_loc, log->l_loc.bits, LOC_MIN_STAL_KB);
+		log->l_stal_limit_blocks = loc_blocks(log->l_loc.loc);
+	} else {
+		log->l_loc.state = LOC_OFF;
+	}
+	mutex_unlock(&log->l_smutex);
+    return len;
+}
+
+static ssize_t loc_window_bits_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", log->l_loc.bits);
+}
+
+static ssize_t loc_window_bits_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int bits;
+
+	if (kstrtouint(buf, 0, &bits) || bits < 1 || bits > LOC_MAX_BITS)
+		return -EINVAL;
+
+	mutex_lock(&log->l_smutex);
+	if (log->l_loc.state == LOC_SEARCH) {
+		loc_reset(&log->l_loc, bits, LOC_MIN_STAL_KB);
+		log->l_stal_limit_blocks = loc_blocks(log->l_loc.loc);
+	} else {
+		log->l_loc.bits = bits; // for the next search
+	}
+	mutex_unlock(&log->l_smutex);
+    return len;
+}
+
+// Slope in percent of merge ratio per KB, in 1/65536
+static ssize_t loc_slope_thr_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lld\n", (long long)log->l_loc.slope_thr);
+}
+
+static ssize_t loc_slope_thr_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	long long thr;
+
+	if (kstrtoll(buf, 0, &thr) || thr < 0)
+		return -EINVAL;
+
+	mutex_lock(&log->l_smutex);
+	log->l_loc.slope_thr = thr;
+	mutex_unlock(&log->l_smutex);
+    return len;
+}
+
+static ssize_t sort_parts_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", log->l_sort_parts);
+}
+
+static ssize_t sort_parts_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int parts;
+
+	if (kstrtouint(buf, 0, &parts) || parts < 1 || parts > LOG_SORT_PARTS)
+		return -EINVAL;
+
+	log->l_sort_parts = parts;
+    return len;
+}
+
+static ssize_t capacity_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", ACCESS_ONCE(log->l_len));
+}
+
+static ssize_t capacity_max_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", log->l_max_len);
+}
+
+static ssize_t capacity_max_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int max_len;
+
+	if (kstrtouint(buf, 0, &max_len))
+		return -EINVAL;
+
+	max_len = log_fix_len(max_len);
+	mutex_lock(&log->l_gmutex);
+	if (max_len < log->l_min_len) {
+		mutex_unlock(&log->l_gmutex);
+		return -EINVAL;
+	}
+	log->l_max_len = max_len;
+	if (log->l_len > max_len) log->l_shrink = 1;
+	mutex_unlock(&log->l_gmutex);
+
+	if (log->l_shrink) wake_up_process(log->l_flusher);
+    return len;
+}
+
+// Pages written back per second of flushing; writing 0 resets it
+static ssize_t flush_rate_show(struct adafs_log *log, char *buf)
+{
+	u64 ns = ACCESS_ONCE(log->l_flush_ns);
+
+	return snprintf(buf, PAGE_SIZE, "%llu\n", ns ?
+			div64_u64((u64)log->l_flushed * NSEC_PER_SEC, ns) : 0ULL);
+}
+
+static ssize_t flush_rate_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val)
+		return -EINVAL;
+
+	mutex_lock(&log->l_fmutex);
+	log->l_flushed = 0;
+	log->l_flush_ns = 0;
+	mutex_unlock(&log->l_fmutex);
+    return len;
+}
+
+static ssize_t group_commit_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", log->l_group_commit);
+}
+
+static ssize_t group_commit_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val > 1)
+		return -EINVAL;
+
+	log->l_group_commit = val;
+    return len;
+}
+
+static ssize_t commits_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lu\n", log->l_commits);
+}
+
+// Percent of capacity_max, with low <= high <= 100
+static ssize_t wmark_low_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", log->l_wmark_low);
+}
+
+static ssize_t wmark_low_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int pct;
+
+	if (kstrtouint(buf, 0, &pct) || pct > log->l_wmark_high)
+		return -EINVAL;
+
+	log->l_wmark_low = pct;
+    return len;
+}
+
+static ssize_t wmark_high_show(struct adafs_log *log, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", log->l_wmark_high);
+}
+
+static ssize_t wmark_high_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int pct;
+
+	if (kstrtouint(buf, 0, &pct) || pct < log->l_wmark_low || pct > 100)
+		return -EINVAL;
+
+	log->l_wmark_high = pct;
+    return len;
+}
+
+// Writer stalls by latency, a line of "<us>\t<count>" per power of two
+static ssize_t write_stalls_show(struct adafs_log *log, char *buf)
+{
+	ssize_t n = 0;
+	int i;
+
+	for (i = 0; i < LOG_STALL_BUCKETS; ++i) {
+		n += snprintf(buf + n, PAGE_SIZE - n, "%lu\t%ld\n",
+				i ? 1UL << (i - 1) : 0UL,
+				atomic_long_read(log->l_stalls + i));
+	}
+	return n;
+}
+
+static ssize_t write_stalls_store(struct adafs_log *log, const char *buf, size_t len)
+{
+	unsigned int val;
+	int i;
+
+	if (kstrtouint(buf, 0, &val) || val)
+		return -EINVAL;
+
+	for (i = 0; i < LOG_STALL_BUCKETS; ++i) {
+		atomic_long_set(log->l_stalls + i, 0);
+	}
     return len;
 }
 
 ADAFS_RW_LA(staleness_sum);
 ADAFS_RW_LA(stal_limit_blocks);
+ADAFS_RW_LA(loc_state);
+ADAFS_RW_LA(loc_window_bits);
+ADAFS_RW_LA(loc_slope_thr);
+ADAFS_RW_LA(sort_parts);
+ADAFS_RO_LA(capacity);
+ADAFS_RW_LA(capacity_max);
+ADAFS_RW_LA(flush_rate);
+ADAFS_RW_LA(group_commit);
+ADAFS_RO_LA(commits);
+ADAFS_RW_LA(wmark_low);
+ADAFS_RW_LA(wmark_high);
+ADAFS_RW_LA(write_stalls);
 
 static struct attribute *adafs_log_attrs[] = {
 		ADAFS_LA(staleness_sum),
 		ADAFS_LA(stal_limit_blocks),
+		ADAFS_LA(loc_state),
+		ADAFS_LA(loc_window_bits),
+		ADAFS_LA(loc_slope_thr),
+		ADAFS_LA(sort_parts),
+		ADAFS_LA(capacity),
+		ADAFS_LA(capacity_max),
+		ADAFS_LA(flush_rate),
+		ADAFS_LA(group_commit),
+		ADAFS_LA(commits),
+		ADAFS_LA(wmark_low),
+		ADAFS_LA(wmark_high),
+		ADAFS_LA(write_stalls),
 		NULL,
 };
 
@@ -359,3 +1445,5 @@ struct kobj_type adafs_la_ktype = {
 	.sysfs_ops		= &adafs_la_ops,
 	.release		= adafs_la_release,
 };
+
+#endif
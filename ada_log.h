@@ -18,46 +18,83 @@
 #ifdef __KERNEL__
 #include <linux/jbd2.h>
 #include <linux/sysfs.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/rcupdate.h>
 #else
 typedef int handle_t;
 #endif
 
 #include "ada_sys.h"
+#include "ada_policy_loc.h"
 
 extern struct flush_operations flush_ops;
 extern struct kobj_type adafs_la_ktype;
 
-#if !defined(LOG_LEN) || !defined(LOG_MASK)
-    #define LOG_LEN 32768 // 32k * 4KB = 128MB
-    #define LOG_MASK 32767
+/*
+ * The ring is made of vmalloc'ed segments of LOG_SEG_LEN slots, mapped by
+ * sequence number through a table covering LOG_MAX_LEN slots. Only the
+ * segments from l_begin up to l_cap_end are attached, so the capacity
+ * grows and shrinks a segment at a time, between the length the log is
+ * created with and its ceiling.
+ */
+#ifndef LOG_DEF_LEN
+    #define LOG_DEF_LEN 32768 // 32k * 4KB = 128MB
 #endif
+#define LOG_SEG_SHIFT	12
+#define LOG_SEG_LEN		(1U << LOG_SEG_SHIFT)
+#define LOG_SEG_MASK	(LOG_SEG_LEN - 1)
+#define LOG_MAX_LEN		(1U << 22) // 4M * 4KB = 16GB
+#define LOG_MAX_SEGS	(LOG_MAX_LEN >> LOG_SEG_SHIFT)
 
-#define L_INDEX(p)  ((p) & LOG_MASK)
+#define LOG_DEF_STAL_LIMIT	4096 // blocks
+
+/*
+ * Watermarks of used slots, in percent of l_max_len. Beyond the low one a
+ * flush is started without waiting for the staleness threshold, and
+ * beyond the high one writers are paused, see log_wmark_pause().
+ */
+#define LOG_WMARK_LOW		50
+#define LOG_WMARK_HIGH		75
+#define LOG_MAX_PAUSE_MS	20
+#define LOG_STALL_BUCKETS	20 // log2 of microseconds
+
+#define L_INDEX(p)		((p) & (LOG_MAX_LEN - 1))
+#define seg_floor(p)	((p) & ~LOG_SEG_MASK)
+#define seg_ceil(p)		seg_floor((p) + LOG_SEG_MASK)
 
 #define seq_dist(a, b)  ((unsigned int)((b) - (a)))
 #define seq_less(a, b)  ((int)((a) - (b)) < 0)
 #define seq_ng(a, b)    ((int)((a) - (b)) <= 0)
 #define L_NULL          UINT_MAX
-#define LE_INVAL_INO	ULONG_MAX
-
-#define LE_PGI_SHIFT	(8)
-#define LE_PGI_MASK		(0xFF)
+#define LE_INVAL_INO	UINT_MAX
 
-#define LE_FLAGS_SHIFT	(PAGE_CACHE_SHIFT + 4)
-#define LE_LEN_SIZE		(PAGE_CACHE_SIZE << 4)
-#define LE_FLAG_MASK	(LE_LEN_SIZE - 1)
-#define LE_LEN_MASK		(~LE_FLAG_MASK)
+#define LE_LEN_BITS		(PAGE_CACHE_SHIFT + 1)
+#define LE_LEN_MASK		((1U << LE_LEN_BITS) - 1)
+#define LE_VER_SHIFT	24
+#define LE_VER_MASK		(0xFFU << LE_VER_SHIFT)
 
-#define LE_META_SETTER	(1 << LE_FLAGS_SHIFT)
+#define LE_META_SETTER	(1U << LE_LEN_BITS)
 #define LE_META_CLEAR	(~LE_META_SETTER)
 #define LE_COW_SETTER	(LE_META_SETTER << 1)
 #define LE_COW_CLEAR	(~LE_COW_SETTER)
+#define LE_NR_SHIFT		(LE_LEN_BITS + 2)
+#define LE_NR_BITS		8
+#define LE_NR_MASK		(((1U << LE_NR_BITS) - 1) << LE_NR_SHIFT)
+#define LE_MAX_PAGES	(1U << LE_NR_BITS)
 
+/*
+ * 16 bytes, four entries per cache line. Inode numbers and page indexes
+ * are 32-bit, and the page is referred to by its frame number.
+ */
 struct log_entry {
-    unsigned long le_ino;
-    unsigned long le_pgi; // low bits are version
-    unsigned long le_flags; // low bits are length
-    void *le_ref;
+    u32 le_ino;
+    u32 le_pgi;
+    u32 le_flags; // version in the high byte, length in low bits
+    u32 le_pfn;
 };
 
 #define le_ino(le)			((le)->le_ino)
@@ -66,15 +103,18 @@ struct log_entry {
 #define le_valid(le)		(!le_inval(le))
 #define le_set_inval(le)	(le_set_ino(le, LE_INVAL_INO))
 
-#define le_pgi(le)				((le)->le_pgi >> LE_PGI_SHIFT)
-#define le_init_pgi(le, pgi)	((le)->le_pgi = ((pgi) << LE_PGI_SHIFT) + 1)
-#define le_ver(le)			((le)->le_pgi & LE_PGI_MASK)
-#define le_set_ver(le, v)	((le)->le_pgi += (v) - le_ver(le))
-#define le_len(le)			((le)->le_flags & LE_FLAG_MASK)
-#define le_init_len(le, l)	((le)->le_flags = (l))
-#define le_set_len(le, l)	((le)->le_flags = ((le)->le_flags & LE_LEN_MASK) + (l))
+#define le_pgi(le)			((le)->le_pgi)
+#define le_ver(le)			((le)->le_flags >> LE_VER_SHIFT)
+#define le_set_ver(le, v)	((le)->le_flags = ((le)->le_flags & ~LE_VER_MASK) | \
+		(((u32)(v) << LE_VER_SHIFT) & LE_VER_MASK))
+#define le_init_pgi(le, pgi)	do { \
+		(le)->le_pgi = (pgi); \
+		le_set_ver(le, 1); } while (0)
+#define le_len(le)			((le)->le_flags & LE_LEN_MASK)
+#define le_init_len(le, l)	((le)->le_flags = ((le)->le_flags & LE_VER_MASK) | (l))
+#define le_set_len(le, l)	((le)->le_flags = ((le)->le_flags & ~LE_LEN_MASK) | (l))
 
-#define le_flags(le)		((le)->le_flags >> LE_FLAGS_SHIFT)
+#define le_flags(le)		(((le)->le_flags & ~LE_VER_MASK) >> LE_LEN_BITS)
 #define le_meta(le)			((le)->le_flags & LE_META_SETTER)
 #define le_set_meta(le)		((le)->le_flags |= LE_META_SETTER)
 #define le_set_data(le)		((le)->le_flags &= LE_META_CLEAR)
@@ -82,23 +122,49 @@ struct log_entry {
 #define le_set_cow(le)		((le)->le_flags |= LE_COW_SETTER)
 #define le_clear_cow(le)	((le)->le_flags &= LE_COW_CLEAR)
 
-#define le_page(le)			((struct page *)(le)->le_ref)
-#define le_set_ref(le, r)	((le)->le_ref = (r))
+/*
+ * A range entry covers pages [pgi, pgi + nr) of its inode, extended in
+ * place by sequential appends while it is active. Its length is that of
+ * the last page, the others being full, and it refers to its first page
+ * for the mapping. Pages are resolved through their rlogs on flushing,
+ * see __range_rlog().
+ */
+#define le_nr_pages(le)		((((le)->le_flags & LE_NR_MASK) >> LE_NR_SHIFT) + 1)
+#define le_set_nr_pages(le, n)	((le)->le_flags = ((le)->le_flags & ~LE_NR_MASK) | \
+		((((u32)(n) - 1) << LE_NR_SHIFT) & LE_NR_MASK))
+#define le_range(le)		((le)->le_flags & LE_NR_MASK)
+#define le_last_pgi(le)		(le_pgi(le) + le_nr_pages(le) - 1)
+#define le_range_size(le) \
+		(((unsigned long)le_nr_pages(le) - 1) * PAGE_CACHE_SIZE + le_len(le))
+/* Whether the first page of @b, sorted after @a, is within @a */
+#define le_overlap(a, b)	(le_ino(a) == le_ino(b) && \
+		le_pgi(b) >= le_pgi(a) && le_pgi(b) <= le_last_pgi(a))
 
-#define LE_INITIALIZER	{ 0, 0, 0, NULL }
+#define le_page(le)			pfn_to_page((le)->le_pfn)
+#define le_set_ref(le, r)	((le)->le_pfn = page_to_pfn(r))
 
-#define LE_DUMP(le)	"ino=%ld, pgi=%lu, ver=%lu, page=%p, len=%lu, flags=%lu\n", \
+#define LE_INITIALIZER	{ 0, 0, 0, 0 }
+
+#define LE_DUMP(le)	"ino=%u, pgi=%u, ver=%u, page=%p, len=%u, flags=%u\n", \
 		le_ino(le), le_pgi(le), le_ver(le), le_page(le), le_len(le), le_flags(le)
 
 #define LE_DUMP_PAGE(le)	"ino=%ld, mapping=%p, index=%lu, page=%p\n", \
 		le_page(le)->mapping && le_page(le)->mapping->host ? le_page(le)->mapping->host->i_ino : LE_INVAL_INO, \
 		le_page(le)->mapping, le_page(le)->index, le_page(le)
 
+/*
+ * Composite sort key: inode number in the high half, page index in the
+ * low half. Invalid entries sort last. Sorts are stable, so entries of
+ * the same page stay in log order, and a meta entry precedes the pages
+ * its inode writes after it.
+ */
+static inline u64 le_key(struct log_entry *le) {
+	return ((u64)le_ino(le) << 32) | le_pgi(le);
+}
+
 static inline int le_cmp(struct log_entry *a, struct log_entry *b) {
-	if (le_ino(a) < le_ino(b)) return -1;
-	else if (le_ino(a) == le_ino(b)) {
-	    return a->le_pgi - b->le_pgi;
-	} else return 1;
+	u64 ka = le_key(a), kb = le_key(b);
+	return ka < kb ? -1 : ka > kb;
 }
 
 struct tran_stat {
@@ -108,16 +174,58 @@ struct tran_stat {
 };
 
 #define init_stat(stat) do {    \
-	stat.merg_size = 0;	\
-	stat.staleness = 0;	\
-	stat.length = 0;	\
+	(stat).merg_size = 0;	\
+	(stat).staleness = 0;	\
+	(stat).length = 0;	\
 } while(0)
 
+/* Stat deltas that writers update without locks */
+struct stat_delta {
+	atomic_long_t merg_size;
+	atomic_long_t staleness;
+	atomic_long_t length;
+};
+
+#define init_stat_delta(d) do {	\
+	atomic_long_set(&(d).merg_size, 0);	\
+	atomic_long_set(&(d).staleness, 0);	\
+	atomic_long_set(&(d).length, 0);	\
+} while(0)
+
+/* Moves all of delta @src to delta @dst */
+#define fold_stat_delta(dst, src) do {	\
+	atomic_long_add(atomic_long_xchg(&(src).merg_size, 0), &(dst).merg_size);	\
+	atomic_long_add(atomic_long_xchg(&(src).staleness, 0), &(dst).staleness);	\
+	atomic_long_add(atomic_long_xchg(&(src).length, 0), &(dst).length);	\
+} while(0)
+
+/* Moves all of delta @src to plain stat @stat */
+#define take_stat_delta(stat, src) do {	\
+	(stat).merg_size = atomic_long_xchg(&(src).merg_size, 0);	\
+	(stat).staleness = atomic_long_xchg(&(src).staleness, 0);	\
+	(stat).length = atomic_long_xchg(&(src).length, 0);	\
+} while(0)
+
+#define add_stat_delta(stat, src) do {	\
+	(stat).merg_size += atomic_long_read(&(src).merg_size);	\
+	(stat).staleness += atomic_long_read(&(src).staleness);	\
+	(stat).length += atomic_long_read(&(src).length);	\
+} while(0)
+
+/*
+ * A transaction of at least LOG_PSORT_MIN entries is partitioned by
+ * inode hash into up to LOG_SORT_PARTS runs sorted in parallel.
+ */
+#define LOG_SORT_PARTS	8
+#define LOG_PSORT_MIN	4096
+
 struct transaction {
     struct tran_stat stat;
     struct list_head list;
     unsigned int begin;
     unsigned int end;
+    unsigned int nr_runs; /* nonzero once sorted into runs in l_runs */
+    unsigned int run_ends[LOG_SORT_PARTS]; /* relative to begin */
 };
 
 #ifdef __KERNEL__
@@ -127,7 +235,8 @@ extern struct kmem_cache *adafs_tran_cachep;
 #define init_tran(tran) do { \
 		init_stat((tran)->stat); \
 		INIT_LIST_HEAD(&(tran)->list); \
-		(tran)->begin = (tran)->end = 0; } while(0)
+		(tran)->begin = (tran)->end = 0; \
+		(tran)->nr_runs = 0; } while(0)
 
 static inline struct transaction *new_tran(void) {
 	struct transaction *tran;
@@ -150,21 +259,216 @@ static inline void evict_tran(struct transaction *tran) {
 
 #define is_tran_open(tran) ((tran)->begin == (tran)->end)
 
+/*
+ * Per-CPU staging area in front of the shared ring.
+ * Each CPU reserves a run of LOG_STAGE_LEN slots at a time with one
+ * cmpxchg on l_end, and fills them with preemption disabled. Staleness
+ * deltas are likewise kept here and folded into l_stat in batches.
+ */
+#define LOG_STAGE_LEN	16
+#define LOG_STAT_BATCH	(PAGE_CACHE_SIZE << 4) /* staleness in bytes */
+
+struct log_stage {
+	unsigned int s_next;    /* next reserved slot to fill */
+	unsigned int s_end;     /* end of reserved slots */
+	struct stat_delta s_delta;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Slot marks. A reserved slot is LM_FREE until its writer claims it
+ * (LM_BUSY) and publishes the entry (LM_READY). A seal turns reserved
+ * slots that nobody has claimed into LM_VOID. Only LM_READY entries are
+ * visible to truncation and flushing.
+ * The state is tagged with the first sequence number of the segment, so
+ * a writer holding a run of slots that has been voided cannot claim them
+ * once the segment is attached for later sequence numbers.
+ */
+#define LM_FREE		0
+#define LM_BUSY		1
+#define LM_READY	2
+#define LM_VOID		3
+
+#define LM_TAG(i)			seg_floor(i)
+#define LM_MARK(i, state)	(LM_TAG(i) | (state))
+
+/* Buffers for sorting a sealed transaction into a run, protected by l_somutex */
+#define RADIX_BITS		8
+#define RADIX_SIZE		(1 << RADIX_BITS)
+#define RADIX_PASSES	(64 / RADIX_BITS)
+
+struct adafs_log;
+
+/* Per-call state of sorting a slice of the sorter buffers */
+struct sort_part {
+    struct adafs_log *log;
+    unsigned int off;       /* offset of the slice in buffers */
+    unsigned int n;
+    unsigned int pos;       /* where the run goes in l_runs */
+    unsigned int count[RADIX_PASSES][RADIX_SIZE];
+    struct work_struct work;
+};
+
+struct log_sorter {
+    u64 *keys;
+    u64 *tkeys;
+    unsigned int *idx;
+    unsigned int *tidx;
+    unsigned int *sorted;   /* result of __log_sort() */
+    unsigned int len;       /* entries the buffers hold */
+    struct sort_part parts[LOG_SORT_PARTS];
+};
+
+/*
+ * A flush merges up to LOG_MERGE_WAYS sorted runs with a loser tree.
+ * Rounds merge into two output buffers in turn, as groups of a round are
+ * still being completed while the next round is merged.
+ * Protected by l_fmutex.
+ */
+#define LOG_MERGE_WAYS	64
+
+/* Max consecutive pages of a file passed to entry_flush_range at once */
+#define LOG_FLUSH_RANGE	32
+
+struct log_run {
+    unsigned int r_next;    /* position in l_runs */
+    unsigned int r_end;
+};
+
+struct log_merger {
+    unsigned int *out;      /* merged sequence numbers, one of outs */
+    unsigned int *outs[2];
+    unsigned int len;       /* entries each of outs holds */
+    unsigned int tree[LOG_MERGE_WAYS];
+    u64 keys[LOG_MERGE_WAYS];
+    struct log_run runs[LOG_MERGE_WAYS];
+};
+
+/*
+ * Entries idx[b, e) flushed with one handle, see __merge_flush(). With
+ * idx NULL, it marks the end of a round whose slots are released up to e.
+ */
+struct flush_group {
+    const unsigned int *idx;
+    unsigned int b;
+    unsigned int e;
+#ifdef __KERNEL__
+    struct inode *inode;    /* of the first entry */
+    tid_t commit_tid;
+    int group_commit;
+    int i_locked;           /* the caller holds i_mutex of inode */
+#endif
+};
+
+/* Groups completed without waiting for their commit */
+struct flush_commit {
+    unsigned int nr_groups;
+#ifdef __KERNEL__
+    struct inode *inode;    /* of the latest group */
+    tid_t tid;
+#endif
+};
+
+/*
+ * Submitted groups are completed in order by l_cmpl_work, which waits for
+ * their writeback, evicts their entries and releases slots at the end of
+ * each round, while the flusher goes on submitting. The queue is filled
+ * by the flusher only.
+ */
+#define LOG_CMPL_LEN	64
+
+#ifdef __KERNEL__
+/* Reverse log of a page to its latest entry, see ada_rlog.h */
+struct rlog {
+	struct hlist_node rl_hnode;
+	struct page *rl_page;
+	unsigned int rl_enti;
+	unsigned int rl_pool;	/* where it is from, RL_SLOT and so on */
+	struct rcu_head rl_rcu;
+	struct rlog *rl_next;	/* more COW copies of a range entry */
+};
+#endif
+
+/* Slots of the ring */
+struct log_seg {
+    struct log_entry s_entries[LOG_SEG_LEN];
+    unsigned int s_marks[LOG_SEG_LEN];
+    unsigned int s_runs[LOG_SEG_LEN];   /* sorted runs, see l_somutex */
+#ifdef __KERNEL__
+    /* Rlogs of the pages of entries, and of their COW copies */
+    struct rlog s_rlogs[LOG_SEG_LEN];
+    struct rlog s_crlogs[LOG_SEG_LEN];
+#endif
+};
+
 struct adafs_log {
-    struct log_entry l_entries[LOG_LEN];
+    struct log_seg *l_segs[LOG_MAX_SEGS];
+    unsigned int l_len;     /* capacity in slots, i.e., attached segments */
+    unsigned int l_min_len; /* capacity kept when shrinking */
+    unsigned int l_max_len; /* ceiling of growing */
+    unsigned int l_cap_end; /* end of attached slots */
+    struct mutex l_gmutex;  /* serializes attaching and detaching segments */
+    int l_shrink;           /* shrinking requested under memory pressure */
+
     unsigned int l_begin;
     struct mutex l_fmutex;  /* protects l_begin and flushing */
+    unsigned int l_ispan_lost; /* entries up to it may lack spans, or L_NULL */
+    struct log_merger l_merger;
+
+    /* Sealed transactions are sorted into runs in s_runs of their slots */
+    struct mutex l_somutex; /* serializes sorting of runs */
+    struct log_sorter l_sorter;
+    struct work_struct l_sort_work;
+    unsigned int l_sort_parts; /* max parts to sort in parallel */
 
     unsigned int l_head;    /* begin of active entries */
-    unsigned int l_end;
+    unsigned int l_end;     /* end of reserved entries, advanced by cmpxchg */
     struct list_head l_trans;
-    spinlock_t l_tlock;     /* protects l_head, l_end, and l_trans */
+    spinlock_t l_tlock;     /* protects l_head and l_trans */
+    struct mutex l_smutex;  /* serializes sealing */
+
+    unsigned long l_flushed;  /* pages flushed */
+    u64 l_flush_ns;           /* time spent in flushing them */
+    unsigned long l_commits;  /* journal commits waited for */
+    int l_group_commit;       /* to commit all groups of a round at once */
+    int l_idle_kick;          /* flush deferred to an idle window, see ada_fs.h */
+    unsigned int l_wmark_low;   /* percent of l_max_len */
+    unsigned int l_wmark_high;
+    atomic_long_t l_stalls[LOG_STALL_BUCKETS]; /* writer stalls by log2 of us */
+
+    struct flush_group l_cq[LOG_CMPL_LEN];
+    unsigned int l_cq_head;   /* next group to complete */
+    unsigned int l_cq_tail;   /* next group to queue */
+    struct mutex l_cmutex;    /* serializes l_cmpl_work */
+    struct work_struct l_cmpl_work;
+    struct flush_commit l_fc;
+    unsigned int l_rounds;    /* rounds completed */
+    wait_queue_head_t l_wq;   /* woken as groups complete and slots are freed */
+#ifdef __KERNEL__
+    struct list_head l_cow_pages; /* spare pages for COW copies */
+    unsigned int l_nr_cow_pages;
+    spinlock_t l_cow_lock;
+#endif
+
+    struct stat_delta l_stat; /* folded stat of the open transaction */
+    atomic_long_t l_stal_sum; /* staleness of sealed transactions not flushed */
+    unsigned int l_stal_limit_blocks; /* staleness to seal at, see ada_policy.h */
+    struct adafs_locator l_loc; /* moves l_stal_limit_blocks, under l_smutex */
+    struct log_stage __percpu *l_stages;
+
+    struct task_struct *l_flusher;
+    struct completion l_fcmpl;  /* completed by l_flusher after each round */
 
     struct kobject l_kobj;
     struct completion l_kobj_unregister;
 };
 
-#define L_ENT(log, i) ((log)->l_entries + L_INDEX(i))
+#define L_SEG(log, i) ((log)->l_segs[L_INDEX(i) >> LOG_SEG_SHIFT])
+#define L_ENT(log, i) (L_SEG(log, i)->s_entries + ((i) & LOG_SEG_MASK))
+#define L_MARK(log, i) (L_SEG(log, i)->s_marks + ((i) & LOG_SEG_MASK))
+#define L_RUN(log, i) (L_SEG(log, i)->s_runs + ((i) & LOG_SEG_MASK))
+#define L_RLOG(log, i) (L_SEG(log, i)->s_rlogs + ((i) & LOG_SEG_MASK))
+#define L_CRLOG(log, i) (L_SEG(log, i)->s_crlogs + ((i) & LOG_SEG_MASK))
+#define le_ready(log, i) (ACCESS_ONCE(*L_MARK(log, i)) == LM_MARK(i, LM_READY))
 
 #define __log_add_tran(log, tran)	\
 	list_add_tail(&(tran)->list, &(log)->l_trans)
@@ -172,23 +476,197 @@ struct adafs_log {
 #define __log_tail_tran(log)	\
 	list_entry((log)->l_trans.prev, struct transaction, list)
 
-static inline void log_init(struct adafs_log *log, struct kset *kset) {
-	struct transaction *tran = new_tran();
-    log->l_begin = 0;
+extern void log_sort_work(struct work_struct *work);
+extern void sort_part_work(struct work_struct *work);
+extern void log_cmpl_work(struct work_struct *work);
+
+/* Rounds a requested capacity to a valid one, in whole segments */
+static inline unsigned int log_fix_len(unsigned int len) {
+	if (len > LOG_MAX_LEN - LOG_SEG_LEN) return LOG_MAX_LEN - LOG_SEG_LEN;
+	if (len < LOG_SEG_LEN) return LOG_SEG_LEN;
+	return seg_ceil(len);
+}
+
+/* Replaces buffers of @*len entries with ones of @n entries at least */
+static inline int __log_grow_bufs(void **bufs[], const size_t sizes[],
+		int nr, unsigned int *len, unsigned int n)
+{
+	void *nbufs[4];
+	int i;
+
+	if (likely(n <= *len)) return 0;
+	n = log_fix_len(n);
+	for (i = 0; i < nr; ++i) {
+		nbufs[i] = vmalloc(n * sizes[i]);
+		if (!nbufs[i]) {
+			while (i--) vfree(nbufs[i]);
+			return -ENOMEM;
+		}
+	}
+	for (i = 0; i < nr; ++i) {
+		vfree(*bufs[i]);
+		*bufs[i] = nbufs[i];
+	}
+	*len = n;
+	return 0;
+}
+
+/*
+ * Sorter buffers follow the largest transaction, which grows with the
+ * capacity. Caller holds l_somutex.
+ */
+static inline int __log_sorter_fit(struct log_sorter *so, unsigned int n) {
+	void **bufs[] = { (void **)&so->keys, (void **)&so->tkeys,
+			(void **)&so->idx, (void **)&so->tidx };
+	const size_t sizes[] = { sizeof(u64), sizeof(u64),
+			sizeof(unsigned int), sizeof(unsigned int) };
+	return __log_grow_bufs(bufs, sizes, 4, &so->len, n);
+}
+
+/* Caller holds l_fmutex */
+static inline int __log_merger_fit(struct log_merger *mg, unsigned int n) {
+	void **bufs[] = { (void **)&mg->outs[0], (void **)&mg->outs[1] };
+	const size_t sizes[] = { sizeof(unsigned int), sizeof(unsigned int) };
+	int err = __log_grow_bufs(bufs, sizes, 2, &mg->len, n);
+	mg->out = mg->outs[0];
+	return err;
+}
+
+/*
+ * Attaches @seg at l_cap_end. Its marks are reset before writers can
+ * reserve its slots. Caller holds l_gmutex.
+ */
+static inline void __log_attach(struct adafs_log *log, struct log_seg *seg) {
+	unsigned int base = log->l_cap_end, j;
+
+	for (j = 0; j < LOG_SEG_LEN; ++j) {
+		seg->s_marks[j] = LM_MARK(base + j, LM_FREE);
+	}
+	L_SEG(log, base) = seg;
+	smp_wmb();
+	ACCESS_ONCE(log->l_cap_end) = base + LOG_SEG_LEN;
+}
+
+static inline void __log_free_bufs(struct adafs_log *log) {
+	unsigned int i;
+
+	for (i = seg_floor(log->l_begin); seq_less(i, log->l_cap_end);
+			i += LOG_SEG_LEN) {
+		vfree(L_SEG(log, i));
+	}
+	vfree(log->l_sorter.keys);
+	vfree(log->l_sorter.tkeys);
+	vfree(log->l_sorter.idx);
+	vfree(log->l_sorter.tidx);
+	vfree(log->l_merger.outs[0]);
+	vfree(log->l_merger.outs[1]);
+	free_percpu(log->l_stages);
+}
+
+/*
+ * Creates the log with @len slots, which may grow up to @max_len slots
+ * under write bursts.
+ */
+static inline int log_init(struct adafs_log *log, struct kset *kset,
+		unsigned int len, unsigned int max_len) {
+	struct log_sorter *so = &log->l_sorter;
+	struct log_merger *mg = &log->l_merger;
+	struct log_seg *seg;
+	struct transaction *tran;
+	unsigned int i;
+	int cpu, err = 0;
+
+	len = log_fix_len(len);
+	max_len = log_fix_len(max_len);
+	memset(log->l_segs, 0, sizeof(log->l_segs));
+	memset(so, 0, sizeof(*so));
+	mg->out = mg->outs[0] = mg->outs[1] = NULL;
+	mg->len = 0;
+	log->l_begin = 0;
+	log->l_cap_end = 0;
+	for (i = 0; i < len; i += LOG_SEG_LEN) {
+		seg = (struct log_seg *)vmalloc(sizeof(struct log_seg));
+		if (!seg) {
+			err = -ENOMEM;
+			break;
+		}
+		__log_attach(log, seg);
+	}
+	log->l_len = len;
+	log->l_min_len = len;
+	log->l_max_len = max_len > len ? max_len : len;
+	log->l_shrink = 0;
+	mutex_init(&log->l_gmutex);
+
+	log->l_stages = alloc_percpu(struct log_stage);
+	if (err || __log_sorter_fit(so, len) || __log_merger_fit(mg, len) ||
+			!log->l_stages) {
+		__log_free_bufs(log);
+		return -ENOMEM;
+	}
+
+	tran = new_tran();
     log->l_end = 0;
     mutex_init(&log->l_fmutex);
+    mutex_init(&log->l_somutex);
+    INIT_WORK(&log->l_sort_work, log_sort_work);
+    log->l_sort_parts = LOG_SORT_PARTS;
+    for (i = 0; i < LOG_SORT_PARTS; ++i) {
+        so->parts[i].log = log;
+        INIT_WORK(&so->parts[i].work, sort_part_work);
+    }
 
     log->l_head = 0;
     INIT_LIST_HEAD(&log->l_trans);
     spin_lock_init(&log->l_tlock);
+    mutex_init(&log->l_smutex);
     __log_add_tran(log, tran);
 
+    init_stat_delta(log->l_stat);
+    atomic_long_set(&log->l_stal_sum, 0);
+    // The locator searches only once enabled through loc_state
+    loc_init(&log->l_loc);
+    log->l_loc.state = LOC_OFF;
+    log->l_stal_limit_blocks = LOG_DEF_STAL_LIMIT;
+    log->l_flushed = 0;
+    log->l_flush_ns = 0;
+    log->l_commits = 0;
+    log->l_group_commit = 1;
+    log->l_idle_kick = 0;
+    log->l_ispan_lost = L_NULL;
+    log->l_wmark_low = LOG_WMARK_LOW;
+    log->l_wmark_high = LOG_WMARK_HIGH;
+    for (i = 0; i < LOG_STALL_BUCKETS; ++i) {
+        atomic_long_set(log->l_stalls + i, 0);
+    }
+    log->l_cq_head = log->l_cq_tail = 0;
+    mutex_init(&log->l_cmutex);
+    INIT_WORK(&log->l_cmpl_work, log_cmpl_work);
+    memset(&log->l_fc, 0, sizeof(struct flush_commit));
+    log->l_rounds = 0;
+    init_waitqueue_head(&log->l_wq);
+#ifdef __KERNEL__
+    INIT_LIST_HEAD(&log->l_cow_pages);
+    log->l_nr_cow_pages = 0;
+    spin_lock_init(&log->l_cow_lock);
+#endif
+    for_each_possible_cpu(cpu) {
+        struct log_stage *st = per_cpu_ptr(log->l_stages, cpu);
+        st->s_next = st->s_end = 0;
+        init_stat_delta(st->s_delta);
+    }
+
+    log->l_flusher = NULL;
+    init_completion(&log->l_fcmpl);
+
     memset(&log->l_kobj, 0, sizeof(struct kobject));
     log->l_kobj.kset = kset;
     init_completion(&log->l_kobj_unregister);
+    return 0;
 }
 
-static inline struct adafs_log *new_log(struct kset *kset)
+static inline struct adafs_log *new_log(struct kset *kset,
+		unsigned int len, unsigned int max_len)
 {
 	struct adafs_log *log;
 #ifdef __KERNEL__
@@ -196,80 +674,356 @@ static inline struct adafs_log *new_log(struct kset *kset)
 #else
 	log = (struct adafs_log *)malloc(sizeof(struct adafs_log));
 #endif
-	log_init(log, kset);
+	if (log && log_init(log, kset, len, max_len)) {
+#ifdef __KERNEL__
+		kfree(log);
+#else
+		free(log);
+#endif
+		log = NULL;
+	}
 	return log;
 }
 
 extern int log_flush(struct adafs_log *log, unsigned int nr);
+#ifdef __KERNEL__
+extern int log_sync_inode(struct adafs_log *log, struct inode *inode,
+		unsigned int first, unsigned int last);
+extern void log_mkclean(struct adafs_log *log, unsigned int begin,
+		unsigned int end);
+#else
+// No page is mapped without the page cache
+#define log_mkclean(log, begin, end)	do { } while (0)
+#endif
 
 static inline void log_destroy(struct adafs_log *log) {
 	struct transaction *pos, *tmp;
+	int i;
 
+	cancel_work_sync(&log->l_sort_work);
+	cancel_work_sync(&log->l_cmpl_work);
+	for (i = 0; i < LOG_SORT_PARTS; ++i) {
+		cancel_work_sync(&log->l_sorter.parts[i].work);
+	}
 	list_for_each_entry_safe(pos, tmp, &log->l_trans, list) {
-		kmem_cache_free(adafs_tran_cachep, pos);
+		evict_tran(pos);
 	}
+	__log_free_bufs(log);
 
 	kobject_put(&log->l_kobj);
 	wait_for_completion(&log->l_kobj_unregister);
 }
 
-static inline int __log_seal(struct adafs_log *log) {
+#define log_get_stage(log)	per_cpu_ptr((log)->l_stages, get_cpu())
+#define log_put_stage(st)	put_cpu()
+
+/* Closes the open transaction at l_head. Caller holds l_tlock. */
+static inline int __log_seal(struct adafs_log *log, unsigned int head) {
 	struct transaction *tran = __log_tail_tran(log);
 
-    if (log->l_head == log->l_end) {
+    if (head == log->l_head) {
         return -ENODATA;
     }
 
-    tran->begin = log->l_head;
-    tran->end = log->l_end;
-    log->l_head = tran->end;
+    tran->begin = head;
+    tran->end = log->l_head;
+    take_stat_delta(tran->stat, log->l_stat);
+    atomic_long_add(tran->stat.staleness, &log->l_stal_sum);
     return 0;
 }
 
+/*
+ * Waits until every slot in [begin, end) is either published or voided.
+ * Unclaimed slots are voided and invalidated, so writers holding them
+ * move on to a fresh run. Claimed ones are only held for an entry copy.
+ */
+static inline void __log_settle(struct adafs_log *log,
+		unsigned int begin, unsigned int end)
+{
+	unsigned int *mark;
+	unsigned int i;
+
+	for (i = begin; seq_less(i, end); ++i) {
+		mark = L_MARK(log, i);
+		if (cmpxchg(mark, LM_MARK(i, LM_FREE), LM_MARK(i, LM_VOID)) ==
+				LM_MARK(i, LM_FREE)) {
+			le_set_inval(L_ENT(log, i));
+			continue;
+		}
+		while (ACCESS_ONCE(*mark) == LM_MARK(i, LM_BUSY))
+			cpu_relax();
+	}
+	smp_rmb();
+}
+
+/*
+ * Feeds the locator with a sealed transaction, sweeping the threshold up
+ * while it searches. Caller holds l_smutex.
+ */
+static inline void __log_locate(struct adafs_log *log,
+		const struct tran_stat *stat) {
+	struct adafs_locator *lc = &log->l_loc;
+
+	if (lc->state != LOC_SEARCH) return;
+	if (!loc_add(lc, stat->staleness, stat->merg_size, LOC_MAX_STAL_KB))
+		lc->loc += LOC_STEP;
+	ACCESS_ONCE(log->l_stal_limit_blocks) = loc_blocks(lc->loc);
+}
+
+/*
+ * Moving l_head first keeps later reservations out of the sealed range.
+ * Once its slots are settled, the transaction holds only complete entries
+ * and can be handed to the flusher. Writers never wait on the seal.
+ * The new transaction is sorted into a run by l_sort_work.
+ */
 static inline int log_seal(struct adafs_log *log) {
 	struct transaction *tran = new_tran();
-	int err;
-    spin_lock(&log->l_tlock);
-    err = __log_seal(log);
-    if (!err) __log_add_tran(log, tran);
-    spin_unlock(&log->l_tlock);
-	if (err) evict_tran(tran);
+	struct tran_stat stat;
+	unsigned int head, end;
+	int cpu, err;
+
+	mutex_lock(&log->l_smutex);
+	spin_lock(&log->l_tlock);
+	head = log->l_head;
+	end = log->l_head = ACCESS_ONCE(log->l_end);
+	spin_unlock(&log->l_tlock);
+
+	__log_settle(log, head, end);
+	for_each_possible_cpu(cpu) {
+		fold_stat_delta(log->l_stat, per_cpu_ptr(log->l_stages, cpu)->s_delta);
+	}
+
+	spin_lock(&log->l_tlock);
+	err = __log_seal(log, head);
+	if (!err) {
+		__log_add_tran(log, tran);
+		stat = tran->stat;
+	}
+	spin_unlock(&log->l_tlock);
+	if (!err) __log_locate(log, &stat);
+	mutex_unlock(&log->l_smutex);
+
+	if (err) {
+		evict_tran(tran);
+	} else {
+		// Before sorting, so that the flusher cannot pick the entries up yet
+		log_mkclean(log, head, end);
+		queue_work(system_unbound_wq, &log->l_sort_work);
+	}
 	return err;
 }
 
+/*
+ * Reserves a new run of attached slots for the stage by a cmpxchg on
+ * l_end. l_cap_end may be lowered below l_end for a moment by
+ * log_shrink().
+ */
+static inline int __log_stage_refill(struct adafs_log *log, struct log_stage *st)
+{
+	unsigned int e, c, n;
+
+	do {
+		e = ACCESS_ONCE(log->l_end);
+		c = ACCESS_ONCE(log->l_cap_end);
+		if (unlikely(seq_ng(c, e))) return -EAGAIN;
+		n = seq_dist(e, c);
+		if (n > LOG_STAGE_LEN) n = LOG_STAGE_LEN;
+	} while (cmpxchg(&log->l_end, e, e + n) != e);
+
+	st->s_next = e;
+	st->s_end = e + n;
+	return 0;
+}
+
+/*
+ * Recycles slots before @end after their entries are flushed. Segments
+ * left behind are attached again at l_cap_end, which keeps the capacity.
+ * Writers holding voided runs in them fail on the new mark tags.
+ * Called by l_cmpl_work while the flusher holds l_fmutex.
+ */
+static inline void __log_release(struct adafs_log *log, unsigned int end)
+{
+	unsigned int i;
+
+	mutex_lock(&log->l_gmutex);
+	for (i = seg_floor(log->l_begin); seq_ng(i + LOG_SEG_LEN, end);
+			i += LOG_SEG_LEN) {
+		__log_attach(log, L_SEG(log, i));
+	}
+	log->l_begin = end;
+	mutex_unlock(&log->l_gmutex);
+}
+
+/* Slots reserved and not released yet */
+#define log_used(log) \
+		seq_dist(ACCESS_ONCE((log)->l_begin), ACCESS_ONCE((log)->l_end))
+
+#define log_wmark(log, pct) (ACCESS_ONCE((log)->l_max_len) / 100 * (pct))
+
+/*
+ * Returns the ms a writer pauses for, rising linearly from the high
+ * watermark to LOG_MAX_PAUSE_MS at l_max_len as balance_dirty_pages()
+ * does, so that writers slow down to the flush rate instead of running
+ * into a full ring. Returns 0 below the high watermark.
+ */
+static inline unsigned int log_wmark_pause(struct adafs_log *log) {
+	unsigned int max = ACCESS_ONCE(log->l_max_len);
+	unsigned int high = log_wmark(log, log->l_wmark_high);
+	unsigned int used = log_used(log);
+
+	if (used <= high) return 0;
+	if (used >= max) return LOG_MAX_PAUSE_MS;
+	// Slot counts are below LOG_MAX_LEN, so the product fits in 32 bits
+	return max_t(unsigned int, 1,
+			LOG_MAX_PAUSE_MS * (used - high) / (max - high));
+}
+
+/* Counts a writer stall of @ns in the histogram */
+static inline void log_stall_add(struct adafs_log *log, u64 ns) {
+	u64 us = div64_u64(ns, 1000);
+	unsigned int b = 0;
+
+	while (us && b < LOG_STALL_BUCKETS - 1) {
+		us >>= 1;
+		++b;
+	}
+	atomic_long_inc(log->l_stalls + b);
+}
+
+/*
+ * Attaches one more segment for a writer that finds the ring full, so
+ * that it need not wait for a flush. Returns 0 if there is room to retry
+ * the append, or -ENOSPC at the ceiling.
+ */
+static inline int log_grow(struct adafs_log *log) {
+	struct log_seg *seg;
+	int err = 0;
+
+	mutex_lock(&log->l_gmutex);
+	if (seq_less(ACCESS_ONCE(log->l_end), log->l_cap_end)) {
+		goto out; // grown or released by others
+	}
+	if (log->l_len + LOG_SEG_LEN > log->l_max_len) {
+		err = -ENOSPC;
+		goto out;
+	}
+	seg = (struct log_seg *)vmalloc(sizeof(struct log_seg));
+	if (!seg) {
+		err = -ENOMEM;
+		goto out;
+	}
+	__log_attach(log, seg);
+	log->l_len += LOG_SEG_LEN;
+	ADAFS_DEBUG(INFO "[adafs] log_grow(): capacity=%u\n", log->l_len);
+out:
+	mutex_unlock(&log->l_gmutex);
+	return err;
+}
+
+/*
+ * Frees attached segments that hold no reserved slot, down to l_min_len.
+ * Called by the flusher when the log is idle or memory is short.
+ * Writers reserve slots with preemption disabled, so after l_cap_end is
+ * lowered, a grace period lets reservations against the old value land
+ * in l_end, and segments beyond both can go.
+ */
+static inline void log_shrink(struct adafs_log *log) {
+	unsigned int old_end, new_end, used;
+
+	mutex_lock(&log->l_gmutex);
+	old_end = log->l_cap_end;
+	new_end = seg_floor(log->l_begin) + log->l_min_len;
+	used = seg_ceil(ACCESS_ONCE(log->l_end));
+	if (seq_less(new_end, used)) new_end = used;
+	if (seq_ng(old_end, new_end)) {
+		mutex_unlock(&log->l_gmutex);
+		return;
+	}
+	ACCESS_ONCE(log->l_cap_end) = new_end;
+	synchronize_sched();
+
+	used = seg_ceil(ACCESS_ONCE(log->l_end));
+	if (seq_less(new_end, used)) {
+		new_end = used;
+		ACCESS_ONCE(log->l_cap_end) = new_end;
+	}
+	for (; seq_less(new_end, old_end); new_end += LOG_SEG_LEN) {
+		vfree(L_SEG(log, new_end));
+		L_SEG(log, new_end) = NULL;
+		log->l_len -= LOG_SEG_LEN;
+	}
+	mutex_unlock(&log->l_gmutex);
+	ADAFS_DEBUG(INFO "[adafs] log_shrink(): capacity=%u\n", log->l_len);
+}
+
 static inline int log_append(struct adafs_log *log, struct log_entry *le,
 		unsigned int *le_seq)
 {
+	struct log_stage *st = log_get_stage(log);
+	unsigned int i = L_NULL;
 	int err = 0;
-	spin_lock(&log->l_tlock);
-	if (seq_dist(log->l_begin, log->l_end) < LOG_LEN) {
-		*L_ENT(log, log->l_end) = *le;
-		if (likely(le_seq)) *le_seq = log->l_end;
+
+	for (;;) {
+		if (st->s_next == st->s_end) {
+			err = __log_stage_refill(log, st);
+			if (unlikely(err)) break;
+		}
+		i = st->s_next++;
+		// A sealed run may be released, and its segment freed, meanwhile
+		if (unlikely(seq_less(i, ACCESS_ONCE(log->l_head)))) {
+			st->s_next = st->s_end;
+			continue;
+		}
+		if (likely(cmpxchg(L_MARK(log, i), LM_MARK(i, LM_FREE),
+				LM_MARK(i, LM_BUSY)) == LM_MARK(i, LM_FREE)))
+			break;
+		st->s_next = st->s_end; // voided by a seal
+	}
+	if (likely(!err)) {
+		*L_ENT(log, i) = *le;
+		smp_wmb();
+		*L_MARK(log, i) = LM_MARK(i, LM_READY);
+		if (likely(le_seq)) *le_seq = i;
 		ADAFS_DEBUG(INFO "[adafs] log_append(): " LE_DUMP(le));
-		++log->l_end;
-	} else err = -EAGAIN;
-	spin_unlock(&log->l_tlock);
+	}
+	log_put_stage(st);
 	return err;
 }
 
-static inline unsigned long __log_stal_sum(struct adafs_log *log) {
-    unsigned long sum = 0;
-    struct transaction *tran;
-    list_for_each_entry(tran, &log->l_trans, list) {
-        sum += tran->stat.staleness;
-    }
-    return sum;
+/*
+ * Accumulates stat changes of the open transaction on the local stage,
+ * and returns in @stat an estimate of its current value.
+ */
+static inline void log_stat_add(struct adafs_log *log, long merg_size,
+		long staleness, long length, struct tran_stat *stat)
+{
+	struct log_stage *st = log_get_stage(log);
+
+	atomic_long_add(merg_size, &st->s_delta.merg_size);
+	atomic_long_add(length, &st->s_delta.length);
+	if (atomic_long_add_return(staleness, &st->s_delta.staleness) >=
+			LOG_STAT_BATCH) {
+		fold_stat_delta(log->l_stat, st->s_delta);
+	}
+	init_stat(*stat);
+	add_stat_delta(*stat, log->l_stat);
+	add_stat_delta(*stat, st->s_delta);
+	log_put_stage(st);
 }
 
+/*
+ * Staleness of all unflushed entries, without the deltas not yet folded
+ * from the stages. Sealed transactions are summed as they are sealed and
+ * flushed, so this reads two counters rather than walking l_trans.
+ */
 static inline unsigned long log_stal_sum(struct adafs_log *log) {
-    unsigned long sum;
-    spin_lock(&log->l_tlock);
-    sum = __log_stal_sum(log);
-    spin_unlock(&log->l_tlock);
-    return sum;
+    return atomic_long_read(&log->l_stal_sum) +
+            atomic_long_read(&log->l_stat.staleness);
 }
 
 extern int __log_sort(struct adafs_log *log, unsigned int begin, unsigned int end);
+extern int __log_qsort(struct adafs_log *log, unsigned int begin, unsigned int end);
+extern unsigned int __log_merge(struct adafs_log *log, unsigned int k);
 
 #ifdef __KERNEL__ /* for sysfs */
 
@@ -10,7 +10,6 @@
 #define ADAFS_POLICY_H_
 
 #define ADAFS_TRAN_LIMIT 16777216 // 4096 blocks, in bytes
-extern unsigned int stal_limit_blocks;
 
 #include "ada_log.h"
 
@@ -22,45 +21,34 @@ extern unsigned int stal_limit_blocks;
 				info, (stat)->staleness, (stat)->merg_size, (stat)->length)
 #endif
 
+// The locator, when enabled, moves the staleness to seal at
+#define policy_seal_limit(log) \
+		(ACCESS_ONCE((log)->l_loc.state) == LOC_OFF ? ADAFS_TRAN_LIMIT : \
+		(unsigned long)ACCESS_ONCE((log)->l_stal_limit_blocks) << PAGE_CACHE_SHIFT)
+
 #define on_write_old_page(log, size) do { \
-		struct tran_stat *sp, stat; \
-		spin_lock(&(log)->l_tlock); \
-		sp = &__log_tail_tran(log)->stat; \
-		sp->merg_size += size; \
-		sp->staleness += size; \
-		stat = *sp; \
-		spin_unlock(&(log)->l_tlock); \
+		struct tran_stat stat; \
+		log_stat_add(log, size, size, 0, &stat); \
 		print_stat("on write old", &stat); \
-		if (stat.staleness >= ADAFS_TRAN_LIMIT) { \
+		if (stat.staleness >= policy_seal_limit(log)) { \
 			log_seal(log); \
-			if (seq_dist(log->l_begin, log->l_end) >= stal_limit_blocks) \
-				wake_up_process(adafs_flusher); \
+			if (seq_dist(log->l_begin, log->l_end) >= log->l_stal_limit_blocks) \
+				adafs_kick_flush(log); \
 		} } while (0)
 
 #define on_write_new_page(log, size) do { \
-		struct tran_stat *sp, stat; \
-		spin_lock(&(log)->l_tlock); \
-		sp = &__log_tail_tran(log)->stat; \
-		sp->staleness += size; \
-		sp->length += 1; \
-		stat = *sp; \
-		spin_unlock(&(log)->l_tlock); \
+		struct tran_stat stat; \
+		log_stat_add(log, 0, size, 1, &stat); \
 		print_stat("on write new", &stat); \
-		if (stat.staleness >= ADAFS_TRAN_LIMIT) { \
+		if (stat.staleness >= policy_seal_limit(log)) { \
 			log_seal(log); \
-			if (seq_dist(log->l_begin, log->l_end) >= stal_limit_blocks) \
-				wake_up_process(adafs_flusher); \
+			if (seq_dist(log->l_begin, log->l_end) >= log->l_stal_limit_blocks) \
+				adafs_kick_flush(log); \
 		} } while (0)
 
 #define on_evict_page(log, size) do { \
-		struct tran_stat *sp, stat; \
-		spin_lock(&(log)->l_tlock); \
-		sp = &__log_tail_tran(log)->stat; \
-		sp->staleness += 1; \
-		sp->merg_size += (size); \
-		sp->length -= 1; \
-		stat = *sp; \
-		spin_unlock(&(log)->l_tlock); \
+		struct tran_stat stat; \
+		log_stat_add(log, size, 1, -1, &stat); \
 		print_stat("on evict page", &stat); \
 		} while (0)
 
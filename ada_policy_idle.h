@@ -0,0 +1,139 @@
+/*
+ * policy_idle.h
+ *
+ * Prediction of idle windows of the user, ported from the state machine of
+ * utrace/test_int_pred.c to integer milliseconds. Intervals between input
+ * events within a threshold keep the user in ST_CON. After that threshold
+ * passes without input, the user is taken as idle in ST_DIS for the
+ * average of past idle intervals, and flushes are scheduled in it.
+ */
+
+#ifndef ADAFS_POLICY_IDLE_H_
+#define ADAFS_POLICY_IDLE_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#else
+#include "ada_sys.h"
+#endif
+
+#define IDLE_LEN_BITS		2	/* as LEN_BITS of test_int_pred.c */
+#define IDLE_INVAL			ULONG_MAX
+#define IDLE_M_SHIFT		8
+#define IDLE_DEF_THR_INT	1000	/* ms, as THR_INT */
+#define IDLE_DEF_THR_M		(3 << IDLE_M_SHIFT) /* as THR_M */
+#define IDLE_MIN_INT		100	/* ms, shorter are dropped by proc-ev-data.py */
+
+enum { ST_CON, ST_DIS, ST_DIS_DOWN, ST_DIS_UP };
+
+enum { EV_USER, EV_TIMER };
+
+/* Latest intervals of a state, as struct adafs_touch_state */
+struct adafs_int_hist {
+	unsigned long array[1 << IDLE_LEN_BITS];
+	unsigned long seq;
+	unsigned long sum;
+	unsigned long timer;
+};
+
+struct adafs_idle {
+	struct adafs_int_hist ts[2];	/* of ST_CON and ST_DIS */
+	unsigned int state;
+	unsigned long thr_int;	/* ms */
+	unsigned long thr_m;	/* << IDLE_M_SHIFT */
+	unsigned long nr_preds;
+	unsigned long nr_conflicts;	/* user back within predicted windows */
+	u64 pred_sum;			/* ms of predicted windows */
+};
+
+static inline void idle_init(struct adafs_idle *id)
+{
+	memset(id, 0, sizeof(struct adafs_idle));
+	id->state = ST_CON;
+	id->thr_int = IDLE_DEF_THR_INT;
+	id->thr_m = IDLE_DEF_THR_M;
+}
+
+static inline void __idle_update_hist(struct adafs_idle *id, int s,
+		unsigned long in)
+{
+	struct adafs_int_hist *h = id->ts + s;
+	unsigned long *head = h->array + (h->seq & ((1 << IDLE_LEN_BITS) - 1));
+
+	h->sum += in - *head;
+	*head = in;
+	++h->seq;
+}
+
+static inline unsigned long __idle_update_timer(struct adafs_idle *id, int s)
+{
+	struct adafs_int_hist *h = id->ts + s;
+	unsigned long len = min_t(unsigned long, h->seq, 1 << IDLE_LEN_BITS);
+
+	h->timer = h->seq ? h->sum / len : id->thr_int;
+	return h->timer;
+}
+
+static inline unsigned long idle_threshold(struct adafs_idle *id)
+{
+	return id->ts[ST_CON].seq ?
+			(id->ts[ST_CON].timer * id->thr_m) >> IDLE_M_SHIFT : id->thr_int;
+}
+
+static inline unsigned long __idle_user(struct adafs_idle *id, unsigned long in)
+{
+	id->state = ST_CON;
+	__idle_update_hist(id, ST_CON, in);
+	__idle_update_timer(id, ST_CON);
+	return idle_threshold(id);
+}
+
+/*
+ * Moves the state by event @ev, @in ms after the last one. Returns the ms
+ * until the timer event, or IDLE_INVAL for none.
+ */
+static inline unsigned long idle_transfer(struct adafs_idle *id, int ev,
+		unsigned long in)
+{
+	switch (id->state) {
+	case ST_CON:
+		if (ev == EV_USER)
+			return __idle_user(id, in);
+		id->state = ST_DIS;
+		return __idle_update_timer(id, ST_DIS);
+	case ST_DIS:
+		++id->nr_preds;
+		id->pred_sum += id->ts[ST_DIS].timer;
+		if (id->ts[ST_DIS].timer > in) ++id->nr_conflicts;
+		if (ev == EV_USER) {
+			if (in <= idle_threshold(id))
+				return __idle_user(id, in);
+			id->state = ST_DIS_DOWN;
+			__idle_update_hist(id, ST_DIS, in);
+			return idle_threshold(id);
+		}
+		id->state = ST_DIS_UP;
+		break;
+	case ST_DIS_DOWN:
+		if (ev == EV_USER)
+			return __idle_user(id, in);
+		id->state = ST_DIS;
+		return __idle_update_timer(id, ST_DIS);
+	case ST_DIS_UP:
+		if (ev == EV_USER) {
+			id->state = ST_CON;
+			__idle_update_hist(id, ST_DIS, in);
+			return idle_threshold(id);
+		}
+		break;
+	}
+	return IDLE_INVAL;
+}
+
+/* The user is interacting, i.e., flushes would compete with the UI */
+#define idle_busy(id) \
+		((id)->state == ST_CON || (id)->state == ST_DIS_DOWN)
+
+#endif /* ADAFS_POLICY_IDLE_H_ */
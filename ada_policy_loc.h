@@ -0,0 +1,136 @@
+/*
+ * policy_loc.h
+ *
+ * Runtime locator of the seal threshold, ported from utrace/test_opt_loc.c
+ * to fixed point. Each seal adds a point (staleness in KB, merge ratio in
+ * percent) to a window of the latest points, on which a line is fitted
+ * incrementally as inc_fit_linear() in ada_policy_util.h does. While the
+ * locator searches, the threshold sweeps up from LOC_MIN_STAL_KB, and it is
+ * fixed at the staleness where the ratio stops improving.
+ */
+
+#ifndef ADAFS_POLICY_LOC_H_
+#define ADAFS_POLICY_LOC_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#else
+#include "ada_sys.h"
+#endif
+
+#define LOC_FP_SHIFT	16	/* of ratios and slopes */
+#define LOC_MAX_BITS	6
+#define LOC_DEF_BITS	4	/* as LEN_BITS of test_opt_loc.c */
+#define LOC_MIN_STAL_KB	24	/* as test_opt_loc.sh */
+#define LOC_MAX_STAL_KB	16384	/* 4096 blocks, as LOG_DEF_STAL_LIMIT */
+#define LOC_MAX_X		(1 << 20) /* KB, for the sums to fit in s64 */
+#define LOC_MIN_RATIO	(10 << LOC_FP_SHIFT) /* percent, as MIN_R */
+#define LOC_DEF_SLOPE_THR	(1 << (LOC_FP_SHIFT - 7)) /* percent per KB */
+#define LOC_STEP		64	/* KB the threshold sweeps by per seal */
+
+enum { LOC_OFF, LOC_SEARCH, LOC_FOUND };
+
+#define loc_blocks(kb)	max_t(unsigned long, (kb) >> (PAGE_CACHE_SHIFT - 10), 1)
+
+struct adafs_fpoint {
+	s64 x;	/* KB */
+	s64 y;	/* percent << LOC_FP_SHIFT */
+};
+
+struct adafs_locator {
+	struct adafs_fpoint array[1 << LOC_MAX_BITS];
+	unsigned long seq;
+	unsigned long mask;
+	unsigned int bits;	/* of the window */
+	s64 s_x;
+	s64 s_y;
+	s64 s_x2;
+	s64 s_xy;
+	s64 slope;		/* percent per KB << LOC_FP_SHIFT */
+	s64 slope_thr;
+	unsigned int skip_peaks;
+	unsigned int state;
+	unsigned long loc;	/* KB found, or swept to while searching */
+};
+
+/* Clears the window of @bits and searches from @min_stal KB */
+static inline void loc_reset(struct adafs_locator *lc, unsigned int bits,
+		unsigned long min_stal)
+{
+	memset(lc->array, 0, sizeof(lc->array));
+	lc->seq = 0;
+	lc->bits = bits;
+	lc->mask = (1UL << bits) - 1;
+	lc->s_x = lc->s_y = lc->s_x2 = lc->s_xy = 0;
+	lc->slope = 0;
+	lc->state = LOC_SEARCH;
+	lc->loc = min_stal;
+}
+
+static inline void loc_init(struct adafs_locator *lc)
+{
+	loc_reset(lc, LOC_DEF_BITS, LOC_MIN_STAL_KB);
+	lc->slope_thr = LOC_DEF_SLOPE_THR;
+	lc->skip_peaks = 0;
+}
+
+/*
+ * Replaces the oldest point with @np and refits, over the whole window as
+ * test_opt_loc.c does. A window of equal x has no slope, and a slope
+ * below the fixed point keeps its sign, which peaks are detected by.
+ */
+static inline s64 loc_fit_linear(struct adafs_locator *lc,
+		const struct adafs_fpoint *np)
+{
+	struct adafs_fpoint *op = lc->array + (lc->seq & lc->mask);
+	s64 n = lc->mask + 1, num, den, slope;
+
+	lc->s_x += np->x - op->x;
+	lc->s_y += np->y - op->y;
+	lc->s_x2 += np->x * np->x - op->x * op->x;
+	lc->s_xy += np->x * np->y - op->x * op->y;
+	*op = *np;
+	++lc->seq;
+
+	den = n * lc->s_x2 - lc->s_x * lc->s_x;
+	if (!den) return 0;
+	num = n * lc->s_xy - lc->s_x * lc->s_y;
+	slope = div64_s64(num, den);
+	if (!slope && num) slope = num < 0 ? -1 : 1;
+	return slope;
+}
+
+/*
+ * Adds the point of a transaction sealed at @staleness bytes with
+ * @merged bytes of them merged. Returns 1 once a threshold is found.
+ */
+static inline int loc_add(struct adafs_locator *lc, u64 staleness,
+		u64 merged, unsigned long max_stal)
+{
+	struct adafs_fpoint p;
+	s64 pre = lc->slope;
+
+	if (!staleness) return 0;
+	p.x = min_t(u64, staleness >> 10, LOC_MAX_X);
+	p.y = div64_u64(merged * (100 << LOC_FP_SHIFT), staleness);
+	lc->slope = loc_fit_linear(lc, &p);
+
+	if (lc->state != LOC_SEARCH) return 0;
+	if (p.x < LOC_MIN_STAL_KB || p.y < LOC_MIN_RATIO) return 0;
+	if (p.x <= max_stal &&
+			!(pre > 0 && lc->slope < 0) &&
+			!(lc->slope > 0 && lc->slope < lc->slope_thr))
+		return 0;
+	if (p.x <= max_stal && lc->skip_peaks) {
+		--lc->skip_peaks;
+		return 0;
+	}
+	lc->state = LOC_FOUND;
+	lc->loc = p.x;
+	return 1;
+}
+
+#endif /* ADAFS_POLICY_LOC_H_ */
@@ -11,8 +11,6 @@
 
 #include "ada_log.h"
 
-extern unsigned int stal_limit_blocks;
-
 #ifdef ADA_RELEASE
 #define print_stat(info, stat)
 #else
@@ -22,42 +20,26 @@ extern unsigned int stal_limit_blocks;
 #endif
 
 #define on_write_old_page(log, size) do { \
-		struct tran_stat *sp, stat; \
-		spin_lock(&(log)->l_tlock); \
-		sp = &__log_tail_tran(log)->stat; \
-		sp->merg_size += size; \
-		sp->staleness += size; \
-		stat = *sp; \
-		spin_unlock(&(log)->l_tlock); \
+		struct tran_stat stat; \
+		log_stat_add(log, size, size, 0, &stat); \
 		print_stat("on write old", &stat); \
-		if (stat.staleness >= (stal_limit_blocks << PAGE_CACHE_SHIFT)) { \
+		if (stat.staleness >= ((log)->l_stal_limit_blocks << PAGE_CACHE_SHIFT)) { \
 			log_seal(log); \
-			wake_up_process(adafs_flusher); \
+			adafs_kick_flush(log); \
 		} } while (0)
 
 #define on_write_new_page(log, size) do { \
-		struct tran_stat *sp, stat; \
-		spin_lock(&(log)->l_tlock); \
-		sp = &__log_tail_tran(log)->stat; \
-		sp->staleness += size; \
-		sp->length += 1; \
-		stat = *sp; \
-		spin_unlock(&(log)->l_tlock); \
+		struct tran_stat stat; \
+		log_stat_add(log, 0, size, 1, &stat); \
 		print_stat("on write new", &stat); \
-		if (stat.staleness >= (stal_limit_blocks << PAGE_CACHE_SHIFT)) { \
+		if (stat.staleness >= ((log)->l_stal_limit_blocks << PAGE_CACHE_SHIFT)) { \
 			log_seal(log); \
-			wake_up_process(adafs_flusher); \
+			adafs_kick_flush(log); \
 		} } while (0)
 
 #define on_evict_page(log, size) do { \
-		struct tran_stat *sp, stat; \
-		spin_lock(&(log)->l_tlock); \
-		sp = &__log_tail_tran(log)->stat; \
-		sp->staleness += 1; \
-		sp->merg_size += (size); \
-		sp->length -= 1; \
-		stat = *sp; \
-		spin_unlock(&(log)->l_tlock); \
+		struct tran_stat stat; \
+		log_stat_add(log, size, 1, -1, &stat); \
 		print_stat("on evict page", &stat); \
 		} while (0)
 
@@ -11,26 +11,90 @@
 
 #include <linux/hash.h>
 #include "shashtable.h"
+#include "rcuhashtable.h"
 #include "ada_log.h"
 
-struct rlog {
-	struct hlist_node rl_hnode;
-	struct page *rl_page;
-	unsigned int rl_enti;
+/*
+ * Rlogs are pooled rather than allocated per page. The rlog of the page
+ * of entry i is L_RLOG(log, i), and that of its COW copy L_CRLOG(log, i),
+ * both bound on appending and reused with the slot. A page waiting for
+ * its entry takes a spare one. Spares run out only with many concurrent
+ * writers, when rlogs fall back to the slab.
+ */
+enum {
+	RL_SLOT,	/* in the slots, freed with them */
+	RL_COPY,	/* in the slots, of a COW copy from l_cow_pages */
+	RL_SPARE,	/* from adafs_rlog_spares */
+	RL_SLAB,	/* from adafs_rlog_cachep */
 };
 
-extern struct kmem_cache *adafs_rlog_cachep;
+#define RLOG_SPARES	256
 
-#define rlog_malloc() \
-		((struct rlog *)kmem_cache_alloc(adafs_rlog_cachep, GFP_KERNEL))
+extern struct kmem_cache *adafs_rlog_cachep;
+extern struct hlist_head adafs_rlog_spares;
+extern spinlock_t adafs_rlog_spare_lock;
+extern unsigned int adafs_rlog_nr_spares;
+extern struct rcuhashtable *page_rlog;
 
 #define rlog_free(p) (kmem_cache_free(adafs_rlog_cachep, p))
 
-#define add_rlog(sht, rlog) \
-		sht_add_entry(sht, rlog, rl_page, rl_hnode)
+/*
+ * Takes a spare rlog, not to sleep with the page locked. Returns NULL if
+ * none is left and the slab has none at hand either.
+ */
+static inline struct rlog *rlog_get_spare(void)
+{
+	struct rlog *rl = NULL;
+
+	spin_lock_bh(&adafs_rlog_spare_lock);
+	if (!hlist_empty(&adafs_rlog_spares)) {
+		rl = hlist_entry(adafs_rlog_spares.first, struct rlog, rl_hnode);
+		hlist_del(&rl->rl_hnode);
+		--adafs_rlog_nr_spares;
+	}
+	spin_unlock_bh(&adafs_rlog_spare_lock);
+	if (rl) {
+		rl->rl_pool = RL_SPARE;
+	} else {
+		rl = (struct rlog *)kmem_cache_alloc(adafs_rlog_cachep,
+				GFP_NOWAIT | __GFP_NOWARN);
+		if (unlikely(!rl)) return NULL;
+		rl->rl_pool = RL_SLAB;
+	}
+	return rl;
+}
+
+/* Also called back by RCU in softirq, hence the _bh locking */
+static inline void rlog_put_spare(struct rlog *rl)
+{
+	spin_lock_bh(&adafs_rlog_spare_lock);
+	if (adafs_rlog_nr_spares < RLOG_SPARES) {
+		hlist_add_head(&rl->rl_hnode, &adafs_rlog_spares);
+		++adafs_rlog_nr_spares;
+		rl = NULL;
+	}
+	spin_unlock_bh(&adafs_rlog_spare_lock);
+	if (rl) rlog_free(rl);
+}
+
+static inline void __rlog_free_rcu(struct rcu_head *head)
+{
+	rlog_put_spare(container_of(head, struct rlog, rl_rcu));
+}
 
-#define find_rlog(sht, page) \
-		sht_find_entry(sht, page, struct rlog, rl_page, rl_hnode)
+/*
+ * Lookups hold no lock, so an evicted rlog is reused after a grace
+ * period. Those in the slots wait for it in log_cmpl_work().
+ */
+#define rlog_free_rcu(p) do { \
+		if ((p)->rl_pool >= RL_SPARE) \
+			call_rcu(&(p)->rl_rcu, __rlog_free_rcu); } while (0)
+
+#define add_rlog(ht, rlog) \
+		rcuht_add(ht, rlog, rl_page, rl_hnode)
+
+#define find_rlog(ht, page) \
+		rcuht_find_entry(ht, page, struct rlog, rl_page, rl_hnode)
 
 #define rl_page(rl)	((rl)->rl_page)
 #define rl_assoc_page(rl, page) { \
@@ -50,19 +114,377 @@ extern struct kmem_cache *adafs_rlog_cachep;
 		ADAFS_DEBUG(INFO "[adafs] assoc_rlog(): " RL_DUMP(rl)); \
 		add_rlog(sht, rl); }
 
-#define evict_rlog(rl) do { \
-		hlist_del(&rl->rl_hnode); \
+#define evict_rlog(ht, rl) do { \
+		rcuht_del(ht, rl, rl_page, rl_hnode); \
 		ADAFS_DEBUG(INFO "[adafs] evict_rlog(): " RL_DUMP(rl)); \
 		put_page((rl)->rl_page); \
-		rlog_free(rl); } while(0)
+		rlog_free_rcu(rl); } while(0)
+
+/*
+ * Moves the page of @rl, with its reference, to @nrl with entry @enti.
+ * A lookup in between finds either, as both have the page. @nrl is taken
+ * by the caller beforehand, as a spare may not be at hand.
+ */
+static inline struct rlog *move_rlog(struct rcuhashtable *ht,
+		struct rlog *rl, struct rlog *nrl, unsigned int enti)
+{
+	nrl->rl_page = rl->rl_page;
+	nrl->rl_enti = enti;
+	add_rlog(ht, nrl);
+	rcuht_del(ht, rl, rl_page, rl_hnode);
+	rlog_free_rcu(rl);
+	return nrl;
+}
+
+/*
+ * COW copies come from a bounded pool of pages of each log, to which they
+ * go back once flushed, rather than from and to the page allocator at the
+ * flush rate. The pool is shrunk by adafs_log_shrinker.
+ */
+#define LOG_COW_PAGES	256
+
+static inline struct page *cow_page_get(struct adafs_log *log,
+		struct address_space *mapping)
+{
+	struct page *page = NULL;
+
+	spin_lock(&log->l_cow_lock);
+	if (!list_empty(&log->l_cow_pages)) {
+		page = list_first_entry(&log->l_cow_pages, struct page, lru);
+		list_del(&page->lru);
+		--log->l_nr_cow_pages;
+	}
+	spin_unlock(&log->l_cow_lock);
+	if (!page) page = page_cache_alloc_cold(mapping);
+	return page;
+}
+
+/*
+ * Takes back a COW copy with the reference of its rlog, besides that of
+ * its allocation. A copy still in use, or with buffers in use, is only
+ * released.
+ */
+static inline void cow_page_put(struct adafs_log *log, struct page *page)
+{
+	if (PageWriteback(page) || !trylock_page(page))
+		goto release;
+	// Buffers of adafs_writepage() hold one more
+	if (page_count(page) != 2 + !!page_has_buffers(page) ||
+			(page_has_buffers(page) && !try_to_free_buffers(page))) {
+		unlock_page(page);
+		goto release;
+	}
+	ClearPageUptodate(page);
+	page->mapping = NULL;
+	unlock_page(page);
+	put_page(page);
+
+	spin_lock(&log->l_cow_lock);
+	if (log->l_nr_cow_pages < LOG_COW_PAGES) {
+		list_add(&page->lru, &log->l_cow_pages);
+		++log->l_nr_cow_pages;
+		page = NULL;
+	}
+	spin_unlock(&log->l_cow_lock);
+release:
+	if (page) put_page(page);
+}
+
+/* Frees up to @nr pooled pages and returns the number left */
+static inline unsigned int cow_pages_shrink(struct adafs_log *log,
+		unsigned int nr)
+{
+	struct page *page;
+	unsigned int left;
+	LIST_HEAD(pages);
 
-static inline void evict_entry(struct log_entry *le, struct shashtable *page_rlog)
+	spin_lock(&log->l_cow_lock);
+	while (nr-- && !list_empty(&log->l_cow_pages)) {
+		page = list_first_entry(&log->l_cow_pages, struct page, lru);
+		list_move(&page->lru, &pages);
+		--log->l_nr_cow_pages;
+	}
+	left = log->l_nr_cow_pages;
+	spin_unlock(&log->l_cow_lock);
+
+	while (!list_empty(&pages)) {
+		page = list_first_entry(&pages, struct page, lru);
+		list_del(&page->lru);
+		put_page(page);
+	}
+	return left;
+}
+
+static inline void evict_entry(struct adafs_log *log, struct log_entry *le,
+		struct rcuhashtable *page_rlog)
 {
 	struct rlog *rl;
 	rl = find_rlog(page_rlog, le_page(le));
 	//ADAFS_BUG_ON(!rl);
-	if (rl) evict_rlog(rl);
-	else printk(KERN_ERR "[adafs] evict_entry no rlog!\n");
+	if (!rl) {
+		printk(KERN_ERR "[adafs] evict_entry no rlog!\n");
+	} else if (rl->rl_pool == RL_COPY) {
+		rcuht_del(page_rlog, rl, rl_page, rl_hnode);
+		ADAFS_DEBUG(INFO "[adafs] evict_entry() recycles: " RL_DUMP(rl));
+		cow_page_put(log, rl_page(rl));
+	} else {
+		evict_rlog(page_rlog, rl);
+	}
+}
+
+/*
+ * Binds COW copy @cpage of a page of range entry @ei. The first copy
+ * takes L_CRLOG(log, ei) and marks the entry COW, and later ones are
+ * chained from it on spare @nrl, taken by the caller not to sleep, and
+ * put back if unused.
+ */
+static inline void range_add_copy(struct adafs_log *log, unsigned int ei,
+		struct page *cpage, struct rlog *nrl)
+{
+	struct log_entry *le = L_ENT(log, ei);
+	struct rlog *crl = L_CRLOG(log, ei);
+
+	spin_lock(&log->l_cow_lock);
+	if (!le_cow(le)) {
+		crl->rl_pool = RL_COPY;
+		crl->rl_next = NULL;
+		assoc_rlog(crl, cpage, ei, page_rlog);
+		le_set_cow(le);
+	} else {
+		assoc_rlog(nrl, cpage, ei, page_rlog);
+		nrl->rl_next = crl->rl_next;
+		crl->rl_next = nrl;
+		nrl = NULL;
+	}
+	if (cpage->index == le_pgi(le))
+		le_set_ref(le, cpage); // the page itself may go first
+	spin_unlock(&log->l_cow_lock);
+	if (nrl) rlog_put_spare(nrl);
+}
+
+/*
+ * Returns the rlog of page @k of range entry @ei in @mapping: its COW copy
+ * if it has one, with @copy set, or else the page if it is still bound to
+ * the entry. A page moved to a newer entry with its copy dropped, or
+ * truncated, has none. The head of the copies has no page once dropped.
+ */
+static inline struct rlog *__range_rlog(struct adafs_log *log,
+		unsigned int ei, struct address_space *mapping, unsigned int k,
+		int *copy)
+{
+	struct log_entry *le = L_ENT(log, ei);
+	pgoff_t index = le_pgi(le) + k;
+	struct rlog *rl;
+	struct page *page;
+
+	*copy = 0;
+	if (le_cow(le)) {
+		spin_lock(&log->l_cow_lock);
+		for (rl = L_CRLOG(log, ei); rl; rl = rl->rl_next) {
+			if (rl_page(rl) && rl_page(rl)->index == index) break;
+		}
+		spin_unlock(&log->l_cow_lock);
+		if (rl) {
+			*copy = 1;
+			return rl;
+		}
+	}
+	page = find_get_page(mapping, index);
+	if (!page) return NULL;
+	rl = find_rlog(page_rlog, page);
+	put_page(page);
+	return rl && rl_enti(rl) == ei ? rl : NULL;
+}
+
+/* Evicts @rl of range entry @ei, a COW copy or a bound page */
+static inline void __range_evict_rlog(struct adafs_log *log,
+		unsigned int ei, struct rlog *rl, int copy)
+{
+	struct rlog **pos;
+	struct page *cpage;
+
+	if (!copy) {
+		evict_rlog(page_rlog, rl);
+		return;
+	}
+	spin_lock(&log->l_cow_lock);
+	for (pos = &L_CRLOG(log, ei)->rl_next; *pos; pos = &(*pos)->rl_next) {
+		if (*pos == rl) {
+			*pos = rl->rl_next;
+			break;
+		}
+	}
+	spin_unlock(&log->l_cow_lock);
+	rcuht_del(page_rlog, rl, rl_page, rl_hnode);
+	cpage = rl_page(rl);
+	if (rl == L_CRLOG(log, ei))
+		rl->rl_page = NULL; // the head stays for the chain
+	else
+		rlog_free_rcu(rl);
+	cow_page_put(log, cpage);
+}
+
+/*
+ * Refers range entry @ei to its first page left from page @k on, as its
+ * first page may go before the entry is flushed. Returns -ENOENT with no
+ * page left, when the caller invalidates the entry.
+ */
+static inline int __range_reref(struct adafs_log *log, unsigned int ei,
+		struct address_space *mapping, unsigned int k)
+{
+	struct log_entry *le = L_ENT(log, ei);
+	unsigned int n = le_nr_pages(le);
+	struct rlog *rl;
+	int copy;
+
+	for (; k < n; ++k) {
+		rl = __range_rlog(log, ei, mapping, k, &copy);
+		if (rl) {
+			le_set_ref(le, rl_page(rl));
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+/*
+ * Drops page @k of range entry @ei, taken over by a newer entry or
+ * truncated. Returns -ENOENT if no page is left.
+ */
+static inline int range_drop_page(struct adafs_log *log, unsigned int ei,
+		unsigned int k)
+{
+	struct address_space *mapping = le_page(L_ENT(log, ei))->mapping;
+	struct rlog *rl;
+	int copy;
+
+	rl = __range_rlog(log, ei, mapping, k, &copy);
+	if (rl) {
+		wait_on_page_writeback(rl_page(rl));
+		__range_evict_rlog(log, ei, rl, copy);
+	}
+	return k ? 0 : __range_reref(log, ei, mapping, 1);
+}
+
+/* Evicts all pages of range entry @ei, after their writeback */
+static inline unsigned int evict_range(struct adafs_log *log, unsigned int ei)
+{
+	struct log_entry *le = L_ENT(log, ei);
+	struct address_space *mapping = le_page(le)->mapping;
+	unsigned int k, n = le_nr_pages(le), nr = 0;
+	struct rlog *rl;
+	int copy;
+
+	for (k = 0; k < n; ++k) {
+		rl = __range_rlog(log, ei, mapping, k, &copy);
+		if (!rl) continue;
+		wait_on_page_writeback(rl_page(rl));
+		__range_evict_rlog(log, ei, rl, copy);
+		++nr;
+	}
+	return nr;
+}
+
+/*
+ * Span of sequence numbers of the entries of an inode in its log, so that
+ * truncating the inode scans the span rather than the whole ring. A span
+ * behind l_begin holds only flushed entries and starts over.
+ */
+struct ispan {
+	struct hlist_node is_hnode;
+	struct inode *is_inode;
+	unsigned int is_first;
+	unsigned int is_last;
+};
+
+extern struct kmem_cache *adafs_ispan_cachep;
+
+#define ispan_malloc() \
+		((struct ispan *)kmem_cache_alloc(adafs_ispan_cachep, GFP_KERNEL))
+
+#define ispan_free(p) (kmem_cache_free(adafs_ispan_cachep, p))
+
+/* Caller holds the lock of @hl */
+static inline struct ispan *__find_ispan(struct hlist_head *hl,
+		struct inode *inode)
+{
+	struct ispan *is;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(is, pos, hl, is_hnode) {
+		if (is->is_inode == inode) return is;
+	}
+	return NULL;
+}
+
+/*
+ * Extends the span of @inode to entry @seq of a log beginning at @begin.
+ * Returns -ENOMEM if a new span cannot be allocated, when the caller
+ * marks spans of the log incomplete.
+ */
+static inline int ispan_add(struct shashtable *sht, struct inode *inode,
+		unsigned int seq, unsigned int begin)
+{
+	struct hlist_head *hl;
+	struct ispan *is, *nis = NULL;
+
+	hl = sht_get_possible_hlist_safe(sht, inode);
+	is = __find_ispan(hl, inode);
+	if (!is) {
+		sht_put_possible_hlist_safe(hl);
+		nis = ispan_malloc();
+		hl = sht_get_possible_hlist_safe(sht, inode);
+		is = __find_ispan(hl, inode);
+		if (!is) {
+			if (unlikely(!nis)) {
+				sht_put_possible_hlist_safe(hl);
+				return -ENOMEM;
+			}
+			is = nis;
+			nis = NULL;
+			is->is_inode = inode;
+			is->is_first = is->is_last = seq;
+			hlist_add_head(&is->is_hnode, hl);
+		}
+	}
+	if (seq_less(is->is_last, begin)) {
+		is->is_first = is->is_last = seq;
+	} else {
+		if (seq_less(seq, is->is_first)) is->is_first = seq;
+		if (seq_less(is->is_last, seq)) is->is_last = seq;
+	}
+	sht_put_possible_hlist_safe(hl);
+	if (nis) ispan_free(nis);
+	return 0;
+}
+
+/* Returns 0 with the span of @inode in @first and @last, if it has one */
+static inline int ispan_get(struct shashtable *sht, struct inode *inode,
+		unsigned int *first, unsigned int *last)
+{
+	struct hlist_head *hl;
+	struct ispan *is;
+
+	hl = sht_get_possible_hlist(sht, inode);
+	is = __find_ispan(hl, inode);
+	if (is) {
+		*first = is->is_first;
+		*last = is->is_last;
+	}
+	sht_put_possible_hlist(hl);
+	return is ? 0 : -ENOENT;
+}
+
+static inline void ispan_del(struct shashtable *sht, struct inode *inode)
+{
+	struct hlist_head *hl;
+	struct ispan *is;
+
+	hl = sht_get_possible_hlist_safe(sht, inode);
+	is = __find_ispan(hl, inode);
+	if (is) hlist_del(&is->is_hnode);
+	sht_put_possible_hlist_safe(hl);
+	if (is) ispan_free(is);
 }
 
 #endif /* ADAFS_RLOG_H_ */
@@ -43,6 +43,9 @@
 #endif
 
 #ifndef __KERNEL__
+    #include <stdlib.h>
+    #include <string.h>
+    #include <assert.h>
     #include "uatomic.h"
     #define likely(cond)    (cond)
     #define unlikely(cond)  (cond)
@@ -50,6 +53,184 @@
     #define PAGE_CACHE_SHIFT    12
     #define PAGE_CACHE_SIZE     (1 << PAGE_CACHE_SHIFT)
     #define PAGE_CACHE_MASK     (~(PAGE_CACHE_SIZE - 1))
+    #define BUG_ON(cond)        assert(!(cond))
+    #define vmalloc(size)       malloc(size)
+    #define vfree(ptr)          free(ptr)
+    #define min_t(type, x, y)   ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+    #define max_t(type, x, y)   ((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+
+    typedef unsigned int u32;
+    typedef unsigned long long u64;
+    typedef long long s64;
+
+    #define div64_u64(a, b)     ((u64)(a) / (u64)(b))
+    #define div64_s64(a, b)     ((s64)(a) / (s64)(b))
+
+    // Page frame numbers of page-aligned addresses below 16TB
+    struct page;
+    #define page_to_pfn(page)   ((unsigned long)(page) >> PAGE_CACHE_SHIFT)
+    #define pfn_to_page(pfn)    ((struct page *)((unsigned long)(pfn) << PAGE_CACHE_SHIFT))
+
+    static inline u32 hash_32(u32 val, unsigned int bits) {
+        return (val * 0x9e370001U) >> (32 - bits);
+    }
+
+    #define smp_wmb()           __sync_synchronize()
+    #define smp_rmb()           __sync_synchronize()
+    #define smp_mb()            __sync_synchronize()
+    #define cpu_relax()         __asm__ __volatile__("" : : : "memory")
+    #define ACCESS_ONCE(x)      (*(volatile typeof(x) *)&(x))
+
+    struct mutex {
+        pthread_mutex_t m;
+    };
+    #define mutex_init(mu) pthread_mutex_init(&(mu)->m, NULL)
+    #define mutex_lock(mu) pthread_mutex_lock(&(mu)->m)
+    #define mutex_unlock(mu) pthread_mutex_unlock(&(mu)->m)
+
+    // No sysfs in user space
+    struct kset;
+    struct kobject {
+        struct kset *kset;
+    };
+    struct completion {
+        int done;
+    };
+    #define init_completion(c) ((c)->done = 0)
+    #define wait_for_completion(c)
+    #define kobject_put(kobj)
+
+    // Work items run synchronously in the caller
+    struct workqueue_struct;
+    struct work_struct {
+        void (*func)(struct work_struct *);
+    };
+    #define system_unbound_wq   ((struct workqueue_struct *)NULL)
+    #define INIT_WORK(w, f)     ((w)->func = (f))
+    static inline int queue_work(struct workqueue_struct *wq,
+            struct work_struct *work) {
+        work->func(work);
+        return 1;
+    }
+    static inline int cancel_work_sync(struct work_struct *work) {
+        return 0;
+    }
+    #define flush_work(w)       do {} while (0)
+
+    // Work items complete before queue_work() returns, so waits are met
+    typedef struct {
+        int unused;
+    } wait_queue_head_t;
+    #define init_waitqueue_head(q)  ((void)(q))
+    #define wake_up_all(q)          ((void)(q))
+    #define wait_event(q, cond)     do { while (!(cond)) cpu_relax(); } while (0)
+
+    // Each thread acts as one CPU, assigned round-robin on first use.
+    // Per-CPU data is accessed without locks, so run at most NR_CPUS threads.
+    #define NR_CPUS 64
+    #define SMP_CACHE_BYTES 64
+    #define ____cacheline_aligned_in_smp __attribute__((aligned(SMP_CACHE_BYTES)))
+    #define __percpu
+
+    extern atomic_t __ucpu_count;
+    extern __thread int __ucpu_id;
+
+    // Odd while the CPU is between get_cpu() and put_cpu()
+    struct __ucpu_region {
+        volatile unsigned long seq;
+    } ____cacheline_aligned_in_smp;
+    extern struct __ucpu_region __ucpu_regions[NR_CPUS];
+
+    static inline int get_cpu(void) {
+        if (unlikely(__ucpu_id < 0))
+            __ucpu_id = (atomic_inc_return(&__ucpu_count) - 1) % NR_CPUS;
+        ++__ucpu_regions[__ucpu_id].seq;
+        smp_mb();
+        return __ucpu_id;
+    }
+    static inline void put_cpu(void) {
+        smp_mb();
+        ++__ucpu_regions[__ucpu_id].seq;
+    }
+
+    // Waits for every CPU to leave the region it is in, if any
+    static inline void synchronize_sched(void) {
+        unsigned long seq;
+        int cpu;
+        smp_mb();
+        for (cpu = 0; cpu < NR_CPUS; ++cpu) {
+            seq = __ucpu_regions[cpu].seq;
+            if (!(seq & 1)) continue;
+            while (__ucpu_regions[cpu].seq == seq)
+                cpu_relax();
+        }
+        smp_mb();
+    }
+    #define for_each_possible_cpu(cpu) \
+        for ((cpu) = 0; (cpu) < NR_CPUS; ++(cpu))
+    #define num_online_cpus()   NR_CPUS
+
+    static inline void *__alloc_percpu(size_t size) {
+        void *p;
+        if (posix_memalign(&p, SMP_CACHE_BYTES, size * NR_CPUS))
+            return NULL;
+        memset(p, 0, size * NR_CPUS);
+        return p;
+    }
+    #define alloc_percpu(type) ((type *)__alloc_percpu(sizeof(type)))
+    #define per_cpu_ptr(ptr, cpu) ((ptr) + (cpu))
+    #define free_percpu(ptr) free(ptr)
+
+    // RCU read sides are the regions of synchronize_sched(), not nested
+    #define rcu_read_lock()     ((void)get_cpu())
+    #define rcu_read_unlock()   put_cpu()
+    #define synchronize_rcu()   synchronize_sched()
+    #define rcu_barrier()       do {} while (0)
+    #define rcu_dereference(p)  ({ typeof(p) __p = ACCESS_ONCE(p); smp_rmb(); __p; })
+    #define rcu_assign_pointer(p, v) do { smp_wmb(); ACCESS_ONCE(p) = (v); } while (0)
+
+    struct rcu_head {
+        struct rcu_head *next;
+        void (*func)(struct rcu_head *head);
+    };
+    static inline void call_rcu(struct rcu_head *head,
+            void (*func)(struct rcu_head *head)) {
+        synchronize_rcu();
+        func(head);
+    }
+
+    static inline void hlist_add_head_rcu(struct hlist_node *n,
+            struct hlist_head *h) {
+        struct hlist_node *first = h->first;
+        n->next = first;
+        n->pprev = &h->first;
+        rcu_assign_pointer(h->first, n);
+        if (first)
+            first->pprev = &n->next;
+    }
+    static inline void hlist_del_rcu(struct hlist_node *n) {
+        __hlist_del(n);
+        n->pprev = LIST_POISON2;
+    }
+
+    typedef pthread_rwlock_t rwlock_t;
+    #define rwlock_init(lock)   pthread_rwlock_init(lock, NULL)
+    #define read_lock(lock)     pthread_rwlock_rdlock(lock)
+    #define read_unlock(lock)   pthread_rwlock_unlock(lock)
+    #define write_lock(lock)    pthread_rwlock_wrlock(lock)
+    #define write_unlock(lock)  pthread_rwlock_unlock(lock)
+#endif
+
+#ifdef __KERNEL__
+    #include <linux/ktime.h>
+    #define adafs_now_ns()  ktime_to_ns(ktime_get())
+#else
+    #include <time.h>
+    static inline unsigned long long adafs_now_ns(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
 #endif
 
 #ifdef ADA_RELEASE
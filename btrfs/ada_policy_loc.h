@@ -0,0 +1 @@
+../ada_policy_loc.h
\ No newline at end of file
@@ -307,7 +307,7 @@ static noinline int btrfs_copy_from_user(loff_t pos, int num_pages,
 					 size_t write_bytes,
 					 struct page **prepared_pages,
 					 struct iov_iter *i,
-					 struct inode *inode) // for AdaFS
+					 struct inode *inode, int *err) // for AdaFS
 {
 	size_t copied = 0;
 	size_t total_copied = 0;
@@ -329,7 +329,11 @@ static noinline int btrfs_copy_from_user(loff_t pos, int num_pages,
 		 */
 
 		// AdaFS:
-		rl = adafs_try_assoc_rlog(inode, page);
+		if (adafs_inode_logged(inode) &&
+				unlikely(!(rl = adafs_try_assoc_rlog(inode, page)))) {
+			*err = -ENOMEM;
+			break;
+		}
 
 		pagefault_disable();
 		copied = iov_iter_copy_from_user_atomic(page, i, offset, count);
@@ -355,7 +359,7 @@ static noinline int btrfs_copy_from_user(loff_t pos, int num_pages,
 		total_copied += copied;
 
 		// AdaFS:
-		adafs_try_append_log(inode, rl, offset, copied);
+		if (rl) adafs_try_append_log(inode, rl, offset, copied);
 
 		/* Return to btrfs_file_aio_write to fault page */
 		if (unlikely(copied == 0))
@@ -1195,6 +1199,7 @@ static noinline ssize_t __btrfs_buffered_write(struct file *file,
 				    PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
 		size_t dirty_pages;
 		size_t copied;
+		int adafs_err = 0; // AdaFS
 
 		WARN_ON(num_pages > nrptrs);
 
@@ -1229,7 +1234,7 @@ static noinline ssize_t __btrfs_buffered_write(struct file *file,
 //		copied = btrfs_copy_from_user(pos, num_pages,
 //				write_bytes, pages, i);
 		copied = btrfs_copy_from_user(pos, num_pages,
-				write_bytes, pages, i, inode);
+				write_bytes, pages, i, inode, &adafs_err);
 		/*
 		 * if we have trouble faulting in the pages, fall
 		 * back to one page at a time
@@ -1278,12 +1283,17 @@ static noinline ssize_t __btrfs_buffered_write(struct file *file,
 
 		balance_dirty_pages_ratelimited_nr(inode->i_mapping,
 						   dirty_pages);
+		adafs_balance_log(inode); // AdaFS
 		if (dirty_pages < (root->leafsize >> PAGE_CACHE_SHIFT) + 1)
 			btrfs_btree_balance_dirty(root, 1);
 		btrfs_throttle(root);
 
 		pos += copied;
 		num_written += copied;
+		if (unlikely(adafs_err)) { // AdaFS
+			ret = adafs_err;
+			break;
+		}
 	}
 
 	kfree(pages);
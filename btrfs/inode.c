@@ -4086,6 +4086,7 @@ static struct dentry *btrfs_lookup(struct inode *dir, struct dentry *dentry,
 	inode = btrfs_lookup_dentry(dir, dentry);
 	if (IS_ERR(inode))
 		return ERR_CAST(inode);
+	adafs_lookup_hook(dir, inode); // AdaFS
 
 	return d_splice_alias(inode, dentry);
 }
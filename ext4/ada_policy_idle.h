@@ -0,0 +1 @@
+../ada_policy_idle.h
\ No newline at end of file
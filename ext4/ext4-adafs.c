@@ -130,26 +130,72 @@ static inline int adafs_writepage(handle_t *handle, struct page *page,
 	return ret;
 }
 
-static inline int adafs_sync_file(struct inode *inode, tid_t commit_tid)
+/*
+ * Writes pages of consecutive indexes in one file through one io submit,
+ * so that their blocks, mapped as one extent, go out in a few large bios
+ * as in mpage_da_submit_io(). Pages that need the journal or buffers
+ * mapped go through adafs_writepage() instead.
+ */
+static int adafs_writepages(handle_t *handle, struct log_entry **les,
+		unsigned int nr, struct writeback_control *wbc)
+{
+	struct ext4_io_submit io_submit;
+	struct inode *inode = le_page(les[0])->mapping->host;
+	struct page *page;
+	loff_t size = i_size_read(inode);
+	unsigned int i, len;
+	int err, ret = 0;
+
+	memset(&io_submit, 0, sizeof(io_submit));
+	for (i = 0; i < nr; ++i) {
+		page = le_page(les[i]);
+		len = le_len(les[i]);
+		if (!page_has_buffers(page) || PageChecked(page) ||
+		    ext4_should_journal_data(inode) ||
+		    walk_page_buffers(NULL, page_buffers(page), 0, len, NULL,
+				      ext4_bh_delay_or_unwritten)) {
+			ext4_io_submit(&io_submit);
+			err = adafs_writepage(handle, page, len, wbc);
+		} else {
+			// Blocks from len on are zeroed, so len is up to i_size
+			// as in mpage_da_submit_io(), not that of the entry
+			if (page->index == size >> PAGE_CACHE_SHIFT)
+				len = size & ~PAGE_CACHE_MASK;
+			else
+				len = PAGE_CACHE_SIZE;
+			err = ext4_bio_write_page(&io_submit, page, len, wbc);
+		}
+		if (unlikely(err) && !ret)
+			ret = err;
+	}
+	ext4_io_submit(&io_submit);
+	return ret;
+}
+
+static int adafs_wait_io(struct inode *inode)
+{
+	if (inode->i_sb->s_flags & MS_RDONLY)
+		return 0;
+
+	return ext4_flush_completed_IO(inode);
+}
+
+/*
+ * Waits for the commit of @commit_tid and flushes the device cache once.
+ * Handles of all inodes on the same journal are covered by their latest
+ * tid, so group commit calls it once per round.
+ */
+static int adafs_wait_commit(struct inode *inode, tid_t commit_tid)
 {
-	//struct inode *inode = file->f_mapping->host;
-	//struct ext4_inode_info *ei = EXT4_I(inode);
 	journal_t *journal = EXT4_SB(inode->i_sb)->s_journal;
 	int ret;
-	//tid_t commit_tid;
 	bool needs_barrier = false;
 
 	J_ASSERT(ext4_journal_current_handle() == NULL);
 
-	//trace_ext4_sync_file_enter(file, datasync);
-
 	if (inode->i_sb->s_flags & MS_RDONLY)
 		return 0;
 
-	ret = ext4_flush_completed_IO(inode);
-	if (ret < 0)
-		goto out;
-
 	BUG_ON(!journal);
 
 	/*
@@ -166,12 +212,9 @@ static inline int adafs_sync_file(struct inode *inode, tid_t commit_tid)
 	 *  (they were dirtied by commit).  But that's OK - the blocks are
 	 *  safe in-journal, which is all fsync() needs to ensure.
 	 */
-	if (ext4_should_journal_data(inode)) {
-		ret = ext4_force_commit(inode->i_sb);
-		goto out;
-	}
+	if (ext4_should_journal_data(inode))
+		return ext4_force_commit(inode->i_sb);
 
-	//commit_tid = datasync ? ei->i_datasync_tid : ei->i_sync_tid;
 	if (journal->j_flags & JBD2_BARRIER &&
 	    !jbd2_trans_will_send_data_barrier(journal, commit_tid))
 		needs_barrier = true;
@@ -179,11 +222,20 @@ static inline int adafs_sync_file(struct inode *inode, tid_t commit_tid)
 	ret = jbd2_log_wait_commit(journal, commit_tid);
 	if (needs_barrier)
 		blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
- out:
-	//trace_ext4_sync_file_exit(inode, ret);
 	return ret;
 }
 
+static inline int adafs_sync_file(struct inode *inode, tid_t commit_tid)
+{
+	int ret;
+
+	ret = adafs_wait_io(inode);
+	if (ret < 0)
+		return ret;
+
+	return adafs_wait_commit(inode, commit_tid);
+}
+
 
 static handle_t *adafs_trans_begin(struct inode *inode, int nles)
 {
@@ -192,12 +244,29 @@ static handle_t *adafs_trans_begin(struct inode *inode, int nles)
 	return ext4_journal_start(inode, nblocks);
 }
 
+/* Entries that fit in the credits of one handle, with half to spare */
+static int adafs_trans_max(struct inode *inode)
+{
+	journal_t *journal = EXT4_SB(inode->i_sb)->s_journal;
+
+	if (!journal)
+		return INT_MAX;
+	return journal->j_max_transaction_buffers / 2 /
+			jbd2_journal_blocks_per_page(inode);
+}
+
 static int adafs_entry_flush(handle_t *handle, struct log_entry *le,
 		struct writeback_control *wbc)
 {
 	return adafs_writepage(handle, le_page(le), le_len(le), wbc);
 }
 
+static int adafs_entry_flush_range(handle_t *handle, struct log_entry **les,
+		unsigned int nr, struct writeback_control *wbc)
+{
+	return adafs_writepages(handle, les, nr, wbc);
+}
+
 static int adafs_trans_end(handle_t *handle)
 {
 	int err;
@@ -219,6 +288,10 @@ static int adafs_wait_sync(struct inode *inode, tid_t commit_tid)
 const struct flush_operations adafs_fops = {
 	.trans_begin = adafs_trans_begin,
 	.entry_flush = adafs_entry_flush,
+	.entry_flush_range = adafs_entry_flush_range,
 	.trans_end = adafs_trans_end,
-	.wait_sync = adafs_wait_sync
+	.wait_sync = adafs_wait_sync,
+	.trans_max = adafs_trans_max,
+	.wait_io = adafs_wait_io,
+	.wait_commit = adafs_wait_commit
 };
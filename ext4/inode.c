@@ -5920,6 +5920,11 @@ int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 	}
 	ret = 0;
 
+	if (adafs_page_mkwrite_hook(inode, page, size)) { /* AdaFS */
+		up_read(&inode->i_alloc_sem);
+		return VM_FAULT_OOM;
+	}
+
 	lock_page(page);
 	wait_on_page_writeback(page);
 	if (PageMappedToDisk(page)) {
@@ -17,6 +17,7 @@
 #include <asm/uaccess.h>
 #include "ext4_jbd2.h"
 #include "ext4.h"
+#include "ada_fs.h"
 
 long ext4_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -367,7 +368,7 @@ mext_out:
 	}
 
 	default:
-		return -ENOTTY;
+		return adafs_ioctl_hook(filp, cmd, arg); /* AdaFS */
 	}
 }
 
@@ -433,6 +434,9 @@ long ext4_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	}
 	case EXT4_IOC_MOVE_EXT:
 	case FITRIM:
+	case ADAFS_IOC_NEW_LOG: /* AdaFS */
+	case ADAFS_IOC_GET_LOG:
+	case ADAFS_IOC_SET_LOG:
 		break;
 	default:
 		return -ENOIOCTLCMD;
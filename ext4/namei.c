@@ -1048,6 +1048,7 @@ static struct dentry *ext4_lookup(struct inode *dir, struct dentry *dentry, stru
 				return ERR_CAST(inode);
 			}
 		}
+		adafs_lookup_hook(dir, inode); // AdaFS
 	}
 	return d_splice_alias(inode, dentry);
 }
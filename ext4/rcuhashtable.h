@@ -0,0 +1 @@
+../rcuhashtable.h
\ No newline at end of file
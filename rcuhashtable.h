@@ -0,0 +1,228 @@
+/*
+ * rcuhashtable.h
+ *
+ * A hashtable with lockless lookups under RCU, which doubles its buckets
+ * as entries grow. Writers lock a stripe of buckets. A resize moves all
+ * entries with writers held off, and a lookup that misses during it
+ * retries on the resize sequence number.
+ */
+
+#ifndef ADAFS_RCUHASHTABLE_H_
+#define ADAFS_RCUHASHTABLE_H_
+
+#ifdef __KERNEL__
+#include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#else
+#include <errno.h>
+#include "ada_sys.h"
+#endif
+
+/* Stripes of locks, i.e., the top bits of hashes, so a bucket is in one */
+#define RCUHT_LOCK_BITS	6
+/* Entries per bucket to grow at */
+#define RCUHT_LOAD		2
+
+struct rcuht_buckets {
+	unsigned int bits;
+	struct hlist_head heads[0];
+};
+
+struct rcuhashtable {
+	struct rcuht_buckets *buckets;	/* replaced under RCU */
+	unsigned int max_bits;
+	long key_offset;		/* of the key from the hlist_node */
+	atomic_t count;
+	unsigned int resize_seq;	/* odd while a resize moves entries */
+	rwlock_t resize_lock;		/* held by writers for read */
+	spinlock_t locks[1 << RCUHT_LOCK_BITS];
+	struct work_struct grow_work;
+};
+
+#define __rcuht_hash(key, bits)	hash_32((u32)(key), (bits))
+
+#define __rcuht_key(ht, node) \
+		(*(unsigned long *)((char *)(node) + (ht)->key_offset))
+
+static inline struct rcuht_buckets *__rcuht_alloc(unsigned int bits)
+{
+	struct rcuht_buckets *b;
+	unsigned int i;
+
+	b = (struct rcuht_buckets *)vmalloc(sizeof(struct rcuht_buckets) +
+			(sizeof(struct hlist_head) << bits));
+	if (!b) return NULL;
+	b->bits = bits;
+	for (i = 0; i < (1U << bits); ++i) {
+		INIT_HLIST_HEAD(b->heads + i);
+	}
+	return b;
+}
+
+/* Doubles the buckets and moves all entries into them */
+static inline void __rcuht_grow(struct rcuhashtable *ht)
+{
+	struct rcuht_buckets *old, *new;
+	struct hlist_node *pos, *next;
+	unsigned int i;
+
+	old = ht->buckets;
+	if (old->bits >= ht->max_bits ||
+			atomic_read(&ht->count) <= (RCUHT_LOAD << old->bits))
+		return;
+	new = __rcuht_alloc(old->bits + 1);
+	if (!new) return;
+
+	write_lock(&ht->resize_lock);
+	ACCESS_ONCE(ht->resize_seq) = ht->resize_seq + 1;
+	smp_wmb();
+	for (i = 0; i < (1U << old->bits); ++i) {
+		for (pos = old->heads[i].first; pos; pos = next) {
+			next = pos->next;
+			// A reader at pos goes on along either list to the end
+			__hlist_del(pos);
+			hlist_add_head_rcu(pos, new->heads +
+					__rcuht_hash(__rcuht_key(ht, pos), new->bits));
+		}
+	}
+	rcu_assign_pointer(ht->buckets, new);
+	smp_wmb();
+	ACCESS_ONCE(ht->resize_seq) = ht->resize_seq + 1;
+	write_unlock(&ht->resize_lock);
+
+	synchronize_rcu();
+	vfree(old);
+}
+
+static inline void __rcuht_grow_work(struct work_struct *work)
+{
+	__rcuht_grow(container_of(work, struct rcuhashtable, grow_work));
+}
+
+/**
+ * rcuht_init - initialize a hashtable of objects of @type
+ * @ht: struct rcuhashtable *
+ * @key_member: the key member, of the size of unsigned long
+ * @node_member: the hlist_node member
+ * @bits: log2 of the initial buckets, at least RCUHT_LOCK_BITS
+ * @max_bits: log2 of the max buckets
+ */
+#define rcuht_init(ht, type, key_member, node_member, bits, max_bits) \
+		__rcuht_init(ht, (long)offsetof(type, key_member) - \
+				(long)offsetof(type, node_member), bits, max_bits)
+
+static inline int __rcuht_init(struct rcuhashtable *ht, long key_offset,
+		unsigned int bits, unsigned int max_bits)
+{
+	int i;
+
+	BUG_ON(bits < RCUHT_LOCK_BITS || max_bits < bits);
+	ht->buckets = __rcuht_alloc(bits);
+	if (!ht->buckets) return -ENOMEM;
+	ht->max_bits = max_bits;
+	ht->key_offset = key_offset;
+	atomic_set(&ht->count, 0);
+	ht->resize_seq = 0;
+	rwlock_init(&ht->resize_lock);
+	for (i = 0; i < (1 << RCUHT_LOCK_BITS); ++i) {
+		spin_lock_init(ht->locks + i);
+	}
+	INIT_WORK(&ht->grow_work, __rcuht_grow_work);
+	return 0;
+}
+
+/* Caller has removed all entries */
+static inline void rcuht_destroy(struct rcuhashtable *ht)
+{
+	cancel_work_sync(&ht->grow_work);
+	vfree(ht->buckets);
+	ht->buckets = NULL;
+}
+
+static inline void __rcuht_add(struct rcuhashtable *ht, unsigned long key,
+		struct hlist_node *node)
+{
+	spinlock_t *lock = ht->locks + __rcuht_hash(key, RCUHT_LOCK_BITS);
+	struct rcuht_buckets *b;
+	unsigned int bits;
+
+	read_lock(&ht->resize_lock);
+	spin_lock(lock);
+	b = ht->buckets;
+	bits = b->bits;
+	hlist_add_head_rcu(node, b->heads + __rcuht_hash(key, bits));
+	spin_unlock(lock);
+	read_unlock(&ht->resize_lock);
+
+	if (atomic_inc_return(&ht->count) > (RCUHT_LOAD << bits) &&
+			bits < ht->max_bits)
+		queue_work(system_unbound_wq, &ht->grow_work);
+}
+
+/* The entry is freed after a grace period, e.g., by call_rcu() */
+static inline void __rcuht_del(struct rcuhashtable *ht, unsigned long key,
+		struct hlist_node *node)
+{
+	spinlock_t *lock = ht->locks + __rcuht_hash(key, RCUHT_LOCK_BITS);
+
+	read_lock(&ht->resize_lock);
+	spin_lock(lock);
+	hlist_del_rcu(node);
+	spin_unlock(lock);
+	read_unlock(&ht->resize_lock);
+	atomic_dec(&ht->count);
+}
+
+#define rcuht_add(ht, obj, key_member, node_member) \
+		__rcuht_add(ht, (unsigned long)(obj)->key_member, &(obj)->node_member)
+
+#define rcuht_del(ht, obj, key_member, node_member) \
+		__rcuht_del(ht, (unsigned long)(obj)->key_member, &(obj)->node_member)
+
+/**
+ * rcuht_find_entry - look up an entry without locks
+ * @ht: struct rcuhashtable *
+ * @key: the key to look up
+ * @type: the type of entries
+ * @key_member: the key member of the entry
+ * @node_member: the hlist_node member of the entry
+ *
+ * The caller keeps the entry from being deleted, as with shashtable.
+ */
+#define rcuht_find_entry(ht, key, type, key_member, node_member) ({ \
+		type *__obj; \
+		struct rcuht_buckets *__b; \
+		struct hlist_node *__pos; \
+		unsigned int __seq; \
+		do { \
+			__seq = ACCESS_ONCE((ht)->resize_seq); \
+			smp_rmb(); \
+			__obj = NULL; \
+			rcu_read_lock(); \
+			__b = rcu_dereference((ht)->buckets); \
+			__pos = rcu_dereference(__b->heads[ \
+					__rcuht_hash((unsigned long)(key), __b->bits)].first); \
+			for (; __pos; __pos = rcu_dereference(__pos->next)) { \
+				if (hlist_entry(__pos, type, node_member)->key_member == (key)) { \
+					__obj = hlist_entry(__pos, type, node_member); \
+					break; \
+				} \
+			} \
+			rcu_read_unlock(); \
+			smp_rmb(); \
+		} while (!__obj && ((__seq & 1) || \
+				ACCESS_ONCE((ht)->resize_seq) != __seq)); \
+		__obj; })
+
+/* Iterates over all entries, with writers stopped */
+#define rcuht_for_each_safe(ht, i, pos, tmp) \
+		for (i = 0; i < (1U << (ht)->buckets->bits); ++i) \
+			hlist_for_each_safe(pos, tmp, (ht)->buckets->heads + i)
+
+#endif /* ADAFS_RCUHASHTABLE_H_ */
@@ -0,0 +1,103 @@
+//
+//  test-append.c
+//  sestet-adafs
+//
+//  Scaling benchmark of log_append() with concurrent writer threads.
+//  Usage: test-append.out [MaxThreads] [AppendsPerThread]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ada_log.h"
+
+#define TRAN_LIMIT (4096 << PAGE_CACHE_SHIFT) // staleness in bytes, as policy
+
+struct writer_arg {
+	struct adafs_log *log;
+	unsigned long ino;
+	int nr_appends;
+};
+
+static double get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *data) {
+	struct writer_arg *arg = (struct writer_arg *)data;
+	struct adafs_log *log = arg->log;
+	struct log_entry le = LE_INITIALIZER;
+	struct tran_stat stat;
+	unsigned int seq;
+	u64 t;
+	int i;
+
+	for (i = 0; i < arg->nr_appends; ++i) {
+		le_set_ino(&le, arg->ino);
+		le_init_pgi(&le, i & 1023);
+		le_init_len(&le, PAGE_CACHE_SIZE);
+		if (log_append(log, &le, &seq) == -EAGAIN) {
+			t = adafs_now_ns();
+			do {
+				log_seal(log);
+				log_flush(log, UINT_MAX);
+			} while (log_append(log, &le, &seq) == -EAGAIN);
+			log_stall_add(log, adafs_now_ns() - t);
+		}
+		log_stat_add(log, 0, PAGE_CACHE_SIZE, 1, &stat);
+		if (stat.staleness >= TRAN_LIMIT) {
+			log_seal(log);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, const char *argv[]) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	int nr_appends = argc > 2 ? atoi(argv[2]) : (1 << 20);
+	struct writer_arg args[NR_CPUS];
+	pthread_t threads[NR_CPUS];
+	int n, i, failed = 0;
+
+	if (max_threads > NR_CPUS) max_threads = NR_CPUS;
+
+	printf("threads\tappends/s\tstalls\tmax stall(us)\n");
+	for (n = 1; n <= max_threads; n <<= 1) {
+		struct adafs_log *log = new_log(NULL, LOG_DEF_LEN, LOG_DEF_LEN);
+		double begin, end;
+		long stalls = 0;
+		int top = 0;
+
+		begin = get_time();
+		for (i = 0; i < n; ++i) {
+			args[i].log = log;
+			args[i].ino = i;
+			args[i].nr_appends = nr_appends;
+			pthread_create(&threads[i], NULL, writer, &args[i]);
+		}
+		for (i = 0; i < n; ++i) {
+			pthread_join(threads[i], NULL);
+		}
+		end = get_time();
+		for (i = 0; i < LOG_STALL_BUCKETS; ++i) {
+			stalls += atomic_long_read(log->l_stalls + i);
+			if (atomic_long_read(log->l_stalls + i)) top = i;
+		}
+		printf("%d\t%.0f\t%ld\t<%lu\n", n, (double)n * nr_appends /
+				(end - begin), stalls, 1UL << top);
+
+		log_seal(log);
+		log_flush(log, UINT_MAX);
+		if (log_stal_sum(log)) {
+			fprintf(stderr, "[Err] staleness %lu is left after flush.\n",
+					log_stal_sum(log));
+			failed = 1;
+		}
+		log_destroy(log);
+		free(log);
+	}
+	return failed;
+}
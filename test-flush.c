@@ -0,0 +1,203 @@
+//
+//  test-flush.c
+//  sestet-adafs
+//
+//  Benchmark of writer stalls with two apps, either sharing one log with
+//  one flusher, or on two logs with a flusher each. Both layouts hold
+//  the same number of slots. App A writes steadily with think time, and
+//  app B writes a burst. Writeback is emulated by the flushers sleeping
+//  for a fixed time per flushed entry.
+//  Usage: test-flush.out [AppendsPerApp] [FlushNsPerEntry]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ada_log.h"
+
+#define NR_APPS		2
+#define TOTAL_LEN	(LOG_DEF_LEN / 2)
+#define THINK_EVERY	256     // appends of app A between pauses
+#define THINK_US	100
+#define KICK_EVERY	64      // appends between checks of the fill level
+
+struct flusher {
+	struct adafs_log *log;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t kick;
+	pthread_cond_t done;    // as l_fcmpl
+	unsigned long rounds;
+	int kicked;
+	int stop;
+};
+
+struct app {
+	struct flusher *fl;
+	unsigned long ino;
+	int nr_appends;
+	int think;
+	double stall;
+	double elapsed;
+};
+
+static int flush_ns = 200;
+
+static double get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ns(unsigned long ns) {
+	struct timespec ts = { ns / 1000000000UL, ns % 1000000000UL };
+	nanosleep(&ts, NULL);
+}
+
+static void *flusher(void *data) {
+	struct flusher *fl = (struct flusher *)data;
+	struct adafs_log *log = fl->log;
+	unsigned int n;
+	int stop;
+
+	do {
+		pthread_mutex_lock(&fl->mutex);
+		while (!fl->kicked && !fl->stop)
+			pthread_cond_wait(&fl->kick, &fl->mutex);
+		fl->kicked = 0;
+		stop = fl->stop;
+		pthread_mutex_unlock(&fl->mutex);
+
+		log_seal(log);
+		n = seq_dist(log->l_begin, ACCESS_ONCE(log->l_head));
+		if (n) {
+			sleep_ns((unsigned long)n * flush_ns);
+			log_flush(log, UINT_MAX);
+		}
+
+		pthread_mutex_lock(&fl->mutex);
+		++fl->rounds;
+		pthread_cond_broadcast(&fl->done);
+		pthread_mutex_unlock(&fl->mutex);
+	} while (!stop);
+	return NULL;
+}
+
+// Wakes the flusher once half the ring is used, as the policy does
+static void kick_flush(struct flusher *fl) {
+	struct adafs_log *log = fl->log;
+
+	if (seq_dist(ACCESS_ONCE(log->l_begin), ACCESS_ONCE(log->l_end)) <
+			log->l_len / 2)
+		return;
+	pthread_mutex_lock(&fl->mutex);
+	fl->kicked = 1;
+	pthread_cond_signal(&fl->kick);
+	pthread_mutex_unlock(&fl->mutex);
+}
+
+// Wakes the flusher and waits for its next round, as adafs_try_append_log()
+static void wait_flush(struct flusher *fl) {
+	unsigned long r;
+
+	pthread_mutex_lock(&fl->mutex);
+	r = fl->rounds;
+	fl->kicked = 1;
+	pthread_cond_signal(&fl->kick);
+	while (fl->rounds == r)
+		pthread_cond_wait(&fl->done, &fl->mutex);
+	pthread_mutex_unlock(&fl->mutex);
+}
+
+static void *writer(void *data) {
+	struct app *app = (struct app *)data;
+	struct adafs_log *log = app->fl->log;
+	struct log_entry le = LE_INITIALIZER;
+	double begin = get_time(), t;
+	int i;
+
+	for (i = 0; i < app->nr_appends; ++i) {
+		le_set_ino(&le, app->ino);
+		le_init_pgi(&le, i);
+		le_init_len(&le, PAGE_CACHE_SIZE);
+		while (log_append(log, &le, NULL) == -EAGAIN) {
+			t = get_time();
+			wait_flush(app->fl);
+			app->stall += get_time() - t;
+		}
+		if (i % KICK_EVERY == KICK_EVERY - 1)
+			kick_flush(app->fl);
+		if (app->think && i % THINK_EVERY == THINK_EVERY - 1)
+			sleep_ns(THINK_US * 1000);
+	}
+	app->elapsed = get_time() - begin;
+	return NULL;
+}
+
+static int run(int nr_logs, int nr_appends) {
+	struct flusher fls[NR_APPS];
+	struct app apps[NR_APPS];
+	int i, err = 0;
+
+	for (i = 0; i < nr_logs; ++i) {
+		memset(&fls[i], 0, sizeof(struct flusher));
+		fls[i].log = new_log(NULL, TOTAL_LEN / nr_logs, TOTAL_LEN / nr_logs);
+		if (!fls[i].log) return -1;
+		pthread_mutex_init(&fls[i].mutex, NULL);
+		pthread_cond_init(&fls[i].kick, NULL);
+		pthread_cond_init(&fls[i].done, NULL);
+		pthread_create(&fls[i].thread, NULL, flusher, &fls[i]);
+	}
+	for (i = 0; i < NR_APPS; ++i) {
+		memset(&apps[i], 0, sizeof(struct app));
+		apps[i].fl = &fls[i % nr_logs];
+		apps[i].ino = i;
+		apps[i].nr_appends = nr_appends;
+		apps[i].think = (i == 0);
+	}
+
+	// Each app runs on its own thread, i.e., its own CPU
+	{
+		pthread_t threads[NR_APPS];
+		for (i = 0; i < NR_APPS; ++i)
+			pthread_create(&threads[i], NULL, writer, &apps[i]);
+		for (i = 0; i < NR_APPS; ++i)
+			pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < nr_logs; ++i) {
+		pthread_mutex_lock(&fls[i].mutex);
+		fls[i].stop = 1;
+		pthread_cond_signal(&fls[i].kick);
+		pthread_mutex_unlock(&fls[i].mutex);
+		pthread_join(fls[i].thread, NULL);
+		if (fls[i].log->l_begin != fls[i].log->l_end) {
+			fprintf(stderr, "[Err] log %d is left with %u entries.\n",
+					i, seq_dist(fls[i].log->l_begin, fls[i].log->l_end));
+			err = -1;
+		}
+		log_destroy(fls[i].log);
+		free(fls[i].log);
+	}
+
+	for (i = 0; i < NR_APPS; ++i) {
+		printf("%s\t%c\t%.1f\t%.0f\n", nr_logs == 1 ? "shared" : "split",
+				'A' + i, apps[i].stall * 1e3,
+				apps[i].nr_appends / apps[i].elapsed);
+	}
+	return err;
+}
+
+int main(int argc, const char *argv[]) {
+	int nr_appends = argc > 1 ? atoi(argv[1]) : (1 << 20);
+	int failed = 0;
+
+	if (argc > 2) flush_ns = atoi(argv[2]);
+
+	printf("logs\tapp\tstall(ms)\tappends/s\n");
+	failed |= !!run(1, nr_appends);
+	failed |= !!run(NR_APPS, nr_appends);
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,198 @@
+//
+//  test-idle.c
+//  sestet-adafs
+//
+//  Replays input intervals through the integer idle predictor of
+//  ada_policy_idle.h and through the floating-point state machine of
+//  utrace/test_int_pred.c, and checks that both make the same predictions
+//  with the same conflicts, i.e., the user back within a predicted idle
+//  window. Intervals come from a file made by utrace/proc-ev-data.py, in
+//  seconds, or else from synthetic sessions of bursts and pauses.
+//  Usage: test-idle.out [EventFile]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "ada_policy_idle.h"
+#include "ada_policy_util.h"
+
+#define NR_INTERVALS	100000
+#define INVAL_TIME		1024.0
+
+struct result {
+	unsigned long nr_preds;
+	unsigned long nr_conflicts;
+	double pred_sum;    // seconds
+};
+
+// The state machine of test_int_pred.c
+struct fp_machine {
+	struct adafs_touch_state ts[2];
+	int s;
+	double thr_int;
+	double thr_m;
+	struct result r;
+};
+
+static double fp_update_timer(struct fp_machine *m, int s) {
+	struct adafs_interval_history *fh = &m->ts[s].int_hist;
+	m->ts[s].timer = fh->seq ? fh_state(fh) / fh_len(fh) : m->thr_int;
+	return m->ts[s].timer;
+}
+
+static double fp_threshold(struct fp_machine *m) {
+	return m->ts[ST_CON].int_hist.seq ? m->ts[ST_CON].timer * m->thr_m :
+			m->thr_int;
+}
+
+static double fp_user(struct fp_machine *m, double in) {
+	m->s = ST_CON;
+	fh_update_interval(&m->ts[ST_CON].int_hist, &in);
+	fp_update_timer(m, ST_CON);
+	return fp_threshold(m);
+}
+
+static double fp_transfer(struct fp_machine *m, int ev, double in) {
+	switch (m->s) {
+	case ST_CON:
+		if (ev == EV_USER) return fp_user(m, in);
+		m->s = ST_DIS;
+		return fp_update_timer(m, ST_DIS);
+	case ST_DIS:
+		++m->r.nr_preds;
+		m->r.pred_sum += m->ts[ST_DIS].timer;
+		if (m->ts[ST_DIS].timer > in) ++m->r.nr_conflicts;
+		if (ev == EV_USER) {
+			if (in <= fp_threshold(m)) return fp_user(m, in);
+			m->s = ST_DIS_DOWN;
+			fh_update_interval(&m->ts[ST_DIS].int_hist, &in);
+			return fp_threshold(m);
+		}
+		m->s = ST_DIS_UP;
+		break;
+	case ST_DIS_DOWN:
+		if (ev == EV_USER) return fp_user(m, in);
+		m->s = ST_DIS;
+		return fp_update_timer(m, ST_DIS);
+	case ST_DIS_UP:
+		if (ev == EV_USER) {
+			m->s = ST_CON;
+			fh_update_interval(&m->ts[ST_DIS].int_hist, &in);
+			return fp_threshold(m);
+		}
+		break;
+	}
+	return INVAL_TIME;
+}
+
+// As main() of test_int_pred.c, with timers passing within intervals
+static struct result replay_fp(const unsigned long *ms, int n) {
+	struct fp_machine m = { { ADAFS_TOUCH_STATE_INIT(IDLE_LEN_BITS),
+			ADAFS_TOUCH_STATE_INIT(IDLE_LEN_BITS) }, ST_CON,
+			IDLE_DEF_THR_INT / 1000.0,
+			(double)IDLE_DEF_THR_M / (1 << IDLE_M_SHIFT) };
+	double timeout = m.thr_int, in;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		in = ms[i] / 1000.0;
+		while (in > timeout) {
+			in -= timeout;
+			timeout = fp_transfer(&m, EV_TIMER, in + timeout);
+		}
+		timeout = fp_transfer(&m, EV_USER, in);
+	}
+	return m.r;
+}
+
+// As the kernel does on input events and timers
+static struct result replay_int(const unsigned long *ms, int n) {
+	struct adafs_idle id;
+	struct result r;
+	unsigned long timeout, in;
+	int i;
+
+	idle_init(&id);
+	timeout = id.thr_int;
+	for (i = 0; i < n; ++i) {
+		in = ms[i];
+		while (in > timeout) {
+			in -= timeout;
+			timeout = idle_transfer(&id, EV_TIMER, in + timeout);
+		}
+		timeout = idle_transfer(&id, EV_USER, in);
+	}
+	r.nr_preds = id.nr_preds;
+	r.nr_conflicts = id.nr_conflicts;
+	r.pred_sum = id.pred_sum / 1000.0;
+	return r;
+}
+
+// Bursts of interaction separated by pauses of reading or thinking
+static int make_intervals(unsigned long *ms, int n) {
+	int i = 0, k;
+
+	while (i < n) {
+		for (k = rand() % 20; k && i < n; --k)
+			ms[i++] = IDLE_MIN_INT + 1 + rand() % 700;
+		if (i < n) ms[i++] = 2000 + rand() % (rand() % 2 ? 5000 : 30000);
+	}
+	return n;
+}
+
+static int read_intervals(const char *file, unsigned long **ms) {
+	double sec;
+	int n = 0, cap = 0;
+	FILE *in = fopen(file, "r");
+
+	*ms = NULL;
+	if (!in) return 0;
+	while (fscanf(in, "%lf", &sec) == 1) {
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			*ms = (unsigned long *)realloc(*ms, cap * sizeof(unsigned long));
+		}
+		(*ms)[n++] = (unsigned long)(sec * 1000 + 0.5);
+	}
+	fclose(in);
+	return n;
+}
+
+// Rounding to ms may flip a decision at a threshold now and then
+static int near(unsigned long a, unsigned long b) {
+	return labs((long)a - (long)b) <= (long)(a + b) / 100 + 1;
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned long *ms;
+	struct result fp, in;
+	int n, failed;
+
+	if (argc > 1) {
+		n = read_intervals(argv[1], &ms);
+	} else {
+		ms = (unsigned long *)malloc(NR_INTERVALS * sizeof(unsigned long));
+		n = make_intervals(ms, NR_INTERVALS);
+	}
+	if (!n) {
+		fprintf(stderr, "[Err] no intervals.\n");
+		return -1;
+	}
+
+	fp = replay_fp(ms, n);
+	in = replay_int(ms, n);
+	printf("impl\tpreds\tconflicts\tavg pred(s)\n");
+	printf("double\t%lu\t%lu\t%.3f\n", fp.nr_preds, fp.nr_conflicts,
+			fp.nr_preds ? fp.pred_sum / fp.nr_preds : 0);
+	printf("integer\t%lu\t%lu\t%.3f\n", in.nr_preds, in.nr_conflicts,
+			in.nr_preds ? in.pred_sum / in.nr_preds : 0);
+
+	failed = !near(fp.nr_preds, in.nr_preds) ||
+			!near(fp.nr_conflicts, in.nr_conflicts);
+	if (failed) fprintf(stderr, "[Err] predictions differ.\n");
+	free(ms);
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
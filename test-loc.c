@@ -0,0 +1,140 @@
+//
+//  test-loc.c
+//  sestet-adafs
+//
+//  Replays seals through the fixed-point locator of ada_policy_loc.h and
+//  through the floating-point one of utrace/test_opt_loc.c, and checks
+//  that both find the same seal threshold. Seals come from a trace made
+//  by utrace/proc-kern-data.py, or else from synthetic ratio curves swept
+//  as the kernel does.
+//  Usage: test-loc.out [DataFile SlopeThreshold]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "ada_policy_loc.h"
+#include "ada_policy_util.h"
+
+#define NR_CURVES	64
+#define NR_SEALS	128
+
+struct seal {
+	u64 staleness;	// bytes
+	u64 merged;
+};
+
+// As the loop of test_opt_loc.c, with the peaks to skip of 0
+static double opt_loc(const struct seal *seals, int n, double thr_s) {
+	struct adafs_curve_history fh = ADAFS_HISTORY_INIT(LOC_DEF_BITS,
+			ADAFS_POINT_ZERO, ADAFS_LINE_STATE_ZERO);
+	double stal = 0, ratio, pre_slope, c1;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		stal = (double)(seals[i].staleness >> 10);
+		ratio = (double)seals[i].merged * 100 / seals[i].staleness;
+		adafs_point p = { stal, ratio };
+		pre_slope = fh_state(&fh).slope;
+		fh_update_curve(&fh, &p);
+		c1 = fh_state(&fh).slope;
+
+		if (stal < LOC_MIN_STAL_KB || ratio < (LOC_MIN_RATIO >> LOC_FP_SHIFT))
+			continue;
+		if (stal > LOC_MAX_STAL_KB) return stal;
+		if ((pre_slope > 0 && c1 < 0) || (c1 > 0 && c1 < thr_s)) return stal;
+	}
+	return stal;
+}
+
+static unsigned long fixed_loc(const struct seal *seals, int n, s64 thr) {
+	struct adafs_locator lc;
+	int i;
+
+	loc_init(&lc);
+	lc.slope_thr = thr;
+	for (i = 0; i < n; ++i) {
+		if (loc_add(&lc, seals[i].staleness, seals[i].merged, LOC_MAX_STAL_KB))
+			return lc.loc;
+	}
+	return seals[n - 1].staleness >> 10;
+}
+
+// Ratio rising to a peak and then falling, with noise, at the sweep steps
+static void make_curve(struct seal *seals, int n) {
+	double top = 30 + rand() % 60, tau = 100 + rand() % 1000;
+	double fall = (rand() % 100) * 1e-5, ratio;
+	unsigned long x = LOC_MIN_STAL_KB;
+	int i;
+
+	for (i = 0; i < n; ++i, x += LOC_STEP) {
+		ratio = top * (1 - exp(-(double)x / tau)) - fall * x +
+				(rand() % 1000) * 1e-3;
+		if (ratio < 0) ratio = 0;
+		if (ratio > 100) ratio = 100;
+		seals[i].staleness = ((u64)x << 10) + rand() % 1024;
+		seals[i].merged = (u64)(ratio / 100 * seals[i].staleness);
+	}
+}
+
+static int check(const struct seal *seals, int n, s64 thr, const char *name) {
+	double opt = opt_loc(seals, n, (double)thr / (1 << LOC_FP_SHIFT));
+	unsigned long loc = fixed_loc(seals, n, thr);
+
+	// Rounding may move a decision by one seal of the sweep
+	if (fabs(opt - loc) > LOC_STEP + 1) {
+		fprintf(stderr, "[Err] %s: fixed point locates %lu KB "
+				"but floating point %.0f KB.\n", name, loc, opt);
+		return -1;
+	}
+	return 0;
+}
+
+static int replay(const char *file, double thr_s) {
+	struct seal *seals = NULL;
+	double time, stal, merg, ratio;
+	int len, n = 0, cap = 0, err;
+	FILE *in = fopen(file, "r");
+
+	if (!in) return -1;
+	while (fscanf(in, "%lf\t%lf\t%lf\t%d\t%lf",
+			&time, &stal, &merg, &len, &ratio) == 5) {
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			seals = (struct seal *)realloc(seals, cap * sizeof(struct seal));
+		}
+		seals[n].staleness = (u64)(stal * 1024);
+		seals[n].merged = (u64)(merg * 1024);
+		if (seals[n].staleness) ++n;
+	}
+	fclose(in);
+	err = n ? check(seals, n, (s64)(thr_s * (1 << LOC_FP_SHIFT)), file) : -1;
+	printf("%s\t%d seals\t%lu KB\n", file, n,
+			n ? fixed_loc(seals, n, (s64)(thr_s * (1 << LOC_FP_SHIFT))) : 0);
+	free(seals);
+	return err;
+}
+
+int main(int argc, const char *argv[]) {
+	static const s64 thrs[] = { 0, LOC_DEF_SLOPE_THR, LOC_DEF_SLOPE_THR << 4 };
+	struct seal seals[NR_SEALS];
+	char name[32];
+	int i, k, failed = 0;
+
+	if (argc > 2) {
+		failed = !!replay(argv[1], atof(argv[2]));
+		printf("%s\n", failed ? "FAILED" : "OK");
+		return failed;
+	}
+
+	for (i = 0; i < NR_CURVES; ++i) {
+		make_curve(seals, NR_SEALS);
+		for (k = 0; k < sizeof(thrs) / sizeof(thrs[0]); ++k) {
+			sprintf(name, "curve %d", i);
+			if (check(seals, NR_SEALS, thrs[k], name)) failed = 1;
+		}
+	}
+	printf("%d curves\t%s\n", NR_CURVES, failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,187 @@
+//
+//  test-ring.c
+//  sestet-adafs
+//
+//  Stress test of lock-free slot reservation in the log ring.
+//  Writer threads append concurrently while a flusher thread seals,
+//  checks and flushes transactions. Every sealed transaction must hold
+//  only complete entries, and each writer's entries must appear in the
+//  order it appended them. The ring starts small: writers grow it when
+//  it is full, and the flusher keeps shrinking it.
+//  Usage: test-ring.out [MaxThreads] [AppendsPerThread]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+
+#include "ada_log.h"
+
+#define le_expected_len(ino, pgi) ((((pgi) * 7) + (ino)) & 0xFFF)
+
+struct ring_test {
+	struct adafs_log *log;
+	int nr_appends;
+	volatile int nr_running;
+	unsigned long last_pgi[NR_CPUS];
+	unsigned long count[NR_CPUS];
+	unsigned long errors;
+	unsigned int max_len;
+};
+
+struct writer_arg {
+	struct ring_test *test;
+	unsigned long ino;
+};
+
+static double get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *data) {
+	struct writer_arg *arg = (struct writer_arg *)data;
+	struct adafs_log *log = arg->test->log;
+	struct log_entry le = LE_INITIALIZER;
+	unsigned long i;
+
+	for (i = 1; i <= arg->test->nr_appends; ++i) {
+		le_set_ino(&le, arg->ino);
+		le_init_pgi(&le, i);
+		le_init_len(&le, le_expected_len(arg->ino, i));
+		while (log_append(log, &le, NULL) == -EAGAIN) {
+			if (!log_grow(log)) continue;
+			log_seal(log);
+			sched_yield();
+		}
+		if ((i & 4095) == 0) log_seal(log);
+	}
+	__sync_fetch_and_sub(&arg->test->nr_running, 1);
+	return NULL;
+}
+
+static int check_tran(struct ring_test *test, unsigned int begin, unsigned int end) {
+	struct adafs_log *log = test->log;
+	struct log_entry *le;
+	unsigned int i;
+	unsigned long ino;
+	unsigned int mark;
+
+	for (i = begin; seq_less(i, end); ++i) {
+		mark = *L_MARK(log, i);
+		le = L_ENT(log, i);
+		if (mark == LM_MARK(i, LM_VOID)) {
+			if (le_valid(le)) ++test->errors;
+			continue;
+		}
+		if (mark != LM_MARK(i, LM_READY)) {
+			PRINT(ERR "slot %u is not settled: mark=%x\n", i, mark);
+			++test->errors;
+			continue;
+		}
+		ino = le_ino(le);
+		if (ino >= NR_CPUS || le_len(le) != le_expected_len(ino, le_pgi(le))) {
+			PRINT(ERR "slot %u is torn\n", i);
+			PRINT(ERR LE_DUMP(le));
+			++test->errors;
+			continue;
+		}
+		if (le_pgi(le) <= test->last_pgi[ino]) {
+			PRINT(ERR "slot %u is out of order: last=%lu\n",
+					i, test->last_pgi[ino]);
+			PRINT(ERR LE_DUMP(le));
+			++test->errors;
+		}
+		test->last_pgi[ino] = le_pgi(le);
+		++test->count[ino];
+	}
+	return 0;
+}
+
+// Checks and flushes sealed transactions one by one
+static void check_flush(struct ring_test *test) {
+	struct adafs_log *log = test->log;
+	struct transaction *tran;
+	unsigned int begin, end;
+
+	for (;;) {
+		spin_lock(&log->l_tlock);
+		tran = list_first_entry(&log->l_trans, struct transaction, list);
+		begin = tran->begin;
+		end = tran->end;
+		spin_unlock(&log->l_tlock);
+		if (begin == end) break;
+		check_tran(test, begin, end);
+		log_flush(log, 1);
+	}
+}
+
+static void *flusher(void *data) {
+	struct ring_test *test = (struct ring_test *)data;
+	while (test->nr_running) {
+		log_seal(test->log);
+		check_flush(test);
+		if (test->log->l_len > test->max_len) test->max_len = test->log->l_len;
+		log_shrink(test->log);
+		sched_yield();
+	}
+	log_seal(test->log);
+	check_flush(test);
+	log_shrink(test->log);
+	return NULL;
+}
+
+int main(int argc, const char *argv[]) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	int nr_appends = argc > 2 ? atoi(argv[2]) : (1 << 20);
+	struct writer_arg args[NR_CPUS];
+	pthread_t threads[NR_CPUS], flusher_thread;
+	struct ring_test test;
+	int n, i, failed = 0;
+
+	if (max_threads > NR_CPUS - 1) max_threads = NR_CPUS - 1;
+
+	printf("threads\tappends/s\tmax slots\tresult\n");
+	for (n = 1; n <= max_threads; n <<= 1) {
+		double begin, end;
+
+		memset(&test, 0, sizeof(test));
+		test.log = new_log(NULL, LOG_SEG_LEN * 2, LOG_DEF_LEN);
+		test.nr_appends = nr_appends;
+		test.nr_running = n;
+
+		begin = get_time();
+		pthread_create(&flusher_thread, NULL, flusher, &test);
+		for (i = 0; i < n; ++i) {
+			args[i].test = &test;
+			args[i].ino = i;
+			pthread_create(&threads[i], NULL, writer, &args[i]);
+		}
+		for (i = 0; i < n; ++i) {
+			pthread_join(threads[i], NULL);
+		}
+		end = get_time();
+		pthread_join(flusher_thread, NULL);
+
+		for (i = 0; i < n; ++i) {
+			if (test.count[i] != nr_appends) {
+				PRINT(ERR "writer %d: %lu of %d entries flushed\n",
+						i, test.count[i], nr_appends);
+				++test.errors;
+			}
+		}
+		if (test.log->l_len != test.log->l_min_len) {
+			PRINT(ERR "%u slots left after shrinking\n", test.log->l_len);
+			++test.errors;
+		}
+		printf("%d\t%.0f\t%u\t%s\n", n, (double)n * nr_appends / (end - begin),
+				test.max_len, test.errors ? "FAILED" : "OK");
+		failed |= !!test.errors;
+
+		log_destroy(test.log);
+		free(test.log);
+	}
+	return failed;
+}
@@ -0,0 +1,174 @@
+//
+//  test-rlog.c
+//  sestet-adafs
+//
+//  Latency of reverse-log lookups as in adafs_try_assoc_rlog(), with the
+//  buckets fixed at 1 << RLOG_HASH_BITS as before or growing with live
+//  pages, and a check that lookups never miss while the table grows
+//  under concurrent readers.
+//  Usage: test-rlog.out [Lookups]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rcuhashtable.h"
+
+#define RLOG_HASH_BITS		10
+#define RLOG_HASH_MAX_BITS	20
+#define NR_READERS			3
+
+struct page {
+	char pad[64]; // as sizeof(struct page)
+};
+
+struct rlog {
+	struct hlist_node rl_hnode;
+	struct page *rl_page;
+	unsigned int rl_enti;
+};
+
+static const unsigned int nr_live[] = { 1 << 10, 1 << 15, 1 << 18 };
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static struct rlog *populate(struct rcuhashtable *ht, struct page *pages,
+		unsigned int n) {
+	struct rlog *rls = (struct rlog *)malloc(n * sizeof(struct rlog));
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		rls[i].rl_page = pages + i;
+		rls[i].rl_enti = i;
+		rcuht_add(ht, rls + i, rl_page, rl_hnode);
+	}
+	return rls;
+}
+
+// Average ns of a lookup of a live page
+static double bench(unsigned int n, unsigned int max_bits, int nr_lookups) {
+	struct rcuhashtable ht;
+	struct page *pages = (struct page *)malloc(n * sizeof(struct page));
+	struct rlog *rls, *rl;
+	unsigned int i;
+	double t;
+	int k;
+
+	if (rcuht_init(&ht, struct rlog, rl_page, rl_hnode,
+			RLOG_HASH_BITS, max_bits)) return -1;
+	rls = populate(&ht, pages, n);
+
+	t = now();
+	for (k = 0; k < nr_lookups; ++k) {
+		i = rand() % n;
+		rl = rcuht_find_entry(&ht, pages + i, struct rlog, rl_page, rl_hnode);
+		if (!rl || rl->rl_enti != i) {
+			fprintf(stderr, "[Err] page %u is not found.\n", i);
+			return -1;
+		}
+	}
+	t = now() - t;
+
+	for (i = 0; i < n; ++i) {
+		rcuht_del(&ht, rls + i, rl_page, rl_hnode);
+	}
+	rcuht_destroy(&ht);
+	free(rls);
+	free(pages);
+	return t * 1e9 / nr_lookups;
+}
+
+struct reader {
+	struct rcuhashtable *ht;
+	struct page *pages;
+	unsigned int n;     // pages added before the reader starts
+	volatile int *stop;
+	unsigned long misses;
+};
+
+static void *read_live(void *data) {
+	struct reader *r = (struct reader *)data;
+	unsigned int i;
+
+	while (!*r->stop) {
+		i = rand() % r->n;
+		if (!rcuht_find_entry(r->ht, r->pages + i, struct rlog,
+				rl_page, rl_hnode))
+			++r->misses;
+	}
+	return NULL;
+}
+
+// Readers look up pages added first while a writer adds more
+static int test_grow(void) {
+	const unsigned int n = nr_live[2];
+	struct rcuhashtable ht;
+	struct page *pages = (struct page *)malloc(n * sizeof(struct page));
+	struct rlog *rls = (struct rlog *)malloc(n * sizeof(struct rlog));
+	struct reader readers[NR_READERS];
+	pthread_t threads[NR_READERS];
+	volatile int stop = 0;
+	unsigned int i;
+	int err = 0;
+
+	if (rcuht_init(&ht, struct rlog, rl_page, rl_hnode,
+			RLOG_HASH_BITS, RLOG_HASH_MAX_BITS)) return -1;
+	for (i = 0; i < n; ++i) {
+		rls[i].rl_page = pages + i;
+		rls[i].rl_enti = i;
+		if (i < (1 << RLOG_HASH_BITS))
+			rcuht_add(&ht, rls + i, rl_page, rl_hnode);
+	}
+	for (i = 0; i < NR_READERS; ++i) {
+		readers[i].ht = &ht;
+		readers[i].pages = pages;
+		readers[i].n = 1 << RLOG_HASH_BITS;
+		readers[i].stop = &stop;
+		readers[i].misses = 0;
+		pthread_create(&threads[i], NULL, read_live, &readers[i]);
+	}
+	for (i = 1 << RLOG_HASH_BITS; i < n; ++i) {
+		rcuht_add(&ht, rls + i, rl_page, rl_hnode);
+	}
+	stop = 1;
+	for (i = 0; i < NR_READERS; ++i) {
+		pthread_join(threads[i], NULL);
+		if (readers[i].misses) {
+			fprintf(stderr, "[Err] reader %u missed %lu lookups.\n",
+					i, readers[i].misses);
+			err = -1;
+		}
+	}
+	printf("grown to %u buckets for %u pages\n", 1U << ht.buckets->bits, n);
+
+	for (i = 0; i < n; ++i) {
+		rcuht_del(&ht, rls + i, rl_page, rl_hnode);
+	}
+	rcuht_destroy(&ht);
+	free(rls);
+	free(pages);
+	return err;
+}
+
+int main(int argc, const char *argv[]) {
+	int nr_lookups = argc > 1 ? atoi(argv[1]) : (1 << 22);
+	double fixed, grown;
+	int i, failed = 0;
+
+	printf("pages\tfixed(ns)\tgrown(ns)\n");
+	for (i = 0; i < sizeof(nr_live) / sizeof(nr_live[0]); ++i) {
+		fixed = bench(nr_live[i], RLOG_HASH_BITS, nr_lookups);
+		grown = bench(nr_live[i], RLOG_HASH_MAX_BITS, nr_lookups);
+		if (fixed < 0 || grown < 0) failed = 1;
+		printf("%u\t%.1f\t%.1f\n", nr_live[i], fixed, grown);
+	}
+
+	if (test_grow()) failed = 1;
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
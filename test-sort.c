@@ -8,38 +8,283 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "ada_log.h"
 
-int main(int argc, const char *argv[]) {
-    struct adafs_log log;
-    struct log_entry entry;
-    int i, j, err, nr_trans, trans_len;
-    log_init(&log);
-    // Two-round appending
-    for (i = 0, err = 0; i < (LOG_LEN * 2) && !err; ++i) {
-    	entry.inode_id = rand() & 255;
-    	entry.index = rand() & 255;
-    	err = log_append(&log, &entry, NULL);
-    }
-    log_seal(&log);
-    log_flush(&log, LOG_LEN);
-
-    // Random appending, sealing and flushing
-    nr_trans = 10;
-    trans_len = LOG_LEN >> 1;
-    for (i = 0; i < nr_trans; ++i) {
-    	int len = rand() % trans_len;
-    	PRINT("(-2)\t%d\n", len);
-    	for (j = 0, err = 0; j < len && !err; ++j) {
-    		entry.inode_id = rand() & 1023;
-    		entry.index = rand() & 1023;
-    		err = log_append(&log, &entry, NULL);
-    	}
-    	log_seal(&log);
-    	if ((i & 1) == 1) log_flush(&log, 2);
-    }
-    log_seal(&log);
-    log_flush(&log, LOG_LEN);
+#define NR_ROUNDS	20
+
+enum { DIST_RANDOM, DIST_SEQUENTIAL, DIST_HOTSPOT, NR_DISTS };
+
+static const char *dist_names[] = { "random", "sequential", "hot-spot" };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fills [begin, begin + LOG_DEF_LEN) with entries of the given distribution
+static void fill(struct adafs_log *log, unsigned int begin, int dist) {
+    struct log_entry *le;
+    unsigned int i;
+    for (i = 0; i < LOG_DEF_LEN; ++i) {
+        le = L_ENT(log, begin + i);
+        switch (dist) {
+        case DIST_RANDOM:
+            le_set_ino(le, rand() & 1023);
+            le_init_pgi(le, rand() & 4095);
+            break;
+        case DIST_SEQUENTIAL:
+            le_set_ino(le, 12 + i / 1024);
+            le_init_pgi(le, i % 1024);
+            break;
+        case DIST_HOTSPOT: // 90% of writes to 16 pages of one file
+            if (rand() % 10) {
+                le_set_ino(le, 12);
+                le_init_pgi(le, rand() & 15);
+            } else {
+                le_set_ino(le, rand() & 1023);
+                le_init_pgi(le, rand() & 4095);
+            }
+            break;
+        }
+        le_set_ver(le, i);
+        if (rand() % 64 == 0) le_set_inval(le);
+        le_init_len(le, i & 0xFFF); // tags the original position
+    }
+}
+
+// Checks order by key and log order among equal keys
+static int check(struct adafs_log *log, unsigned int begin,
+        const unsigned int *idx) {
+    unsigned int k;
+    for (k = 0; k < LOG_DEF_LEN; ++k) {
+        if (seq_dist(begin, idx[k]) >= LOG_DEF_LEN) return -1;
+        if (le_len(L_ENT(log, idx[k])) != (seq_dist(begin, idx[k]) & 0xFFF))
+            return -1;
+        if (k == 0) continue;
+        if (le_key(L_ENT(log, idx[k - 1])) > le_key(L_ENT(log, idx[k])))
+            return -1;
+        if (le_key(L_ENT(log, idx[k - 1])) == le_key(L_ENT(log, idx[k])) &&
+                !seq_less(idx[k - 1], idx[k]))
+            return -1;
+    }
+    return 0;
+}
+
+#define MERGE_INOS	64
+#define MERGE_PGIS	256
+
+// Appends entries in sealed transactions and merges all of them
+static int test_merge(void) {
+    static unsigned int last[MERGE_INOS][MERGE_PGIS];
+    static unsigned long max_len[MERGE_INOS][MERGE_PGIS];
+    struct adafs_log *log = new_log(NULL, LOG_DEF_LEN, LOG_DEF_LEN);
+    struct log_merger *mg;
+    struct log_entry entry = LE_INITIALIZER, *le, *prev = NULL;
+    struct transaction *tran;
+    unsigned int i, k = 0, n, nr, seq, nr_pages = 0, nr_metas = 0;
+    unsigned long ino, pgi;
+    double t;
+
+    if (!log) return -1;
+    mg = &log->l_merger;
+    memset(last, 0xFF, sizeof(last));
+    memset(max_len, 0, sizeof(max_len));
+    for (i = 0; i < LOG_DEF_LEN - LOG_DEF_LEN / 16; ++i) {
+        le_set_ino(&entry, rand() % MERGE_INOS);
+        le_init_len(&entry, rand() & 0xFFF);
+        if (rand() % 100 == 0) { // as adafs_new_inode_hook() appends
+            entry.le_pgi = 0;
+            le_set_meta(&entry);
+        } else {
+            le_init_pgi(&entry, rand() % MERGE_PGIS);
+        }
+        if (log_append(log, &entry, &seq)) return -1;
+        // Small transactions, then ones sorted in parts
+        if (i < LOG_DEF_LEN / 2 ? (i & 1023) == 1023 : (i & 8191) == 8191)
+            log_seal(log);
+    }
+    log_seal(log);
+    nr = i;
+
+    // Entries truncated after their runs are sorted
+    for (seq = 0; seq < nr; ++seq) {
+        le = L_ENT(log, seq);
+        if (rand() % 50 == 0) le_set_inval(le);
+        if (le_inval(le)) continue;
+        if (le_meta(le)) {
+            ++nr_metas;
+            continue;
+        }
+        ino = le_ino(le);
+        pgi = le_pgi(le);
+        if (last[ino][pgi] == L_NULL) ++nr_pages;
+        last[ino][pgi] = seq;
+        if (le_len(le) > max_len[ino][pgi]) max_len[ino][pgi] = le_len(le);
+    }
+
+    list_for_each_entry(tran, &log->l_trans, list) {
+        if (is_tran_open(tran) || !tran->nr_runs ||
+                k + tran->nr_runs > LOG_MERGE_WAYS) break;
+        for (i = 0; i < tran->nr_runs; ++i, ++k) {
+            mg->runs[k].r_next = tran->begin + (i ? tran->run_ends[i - 1] : 0);
+            mg->runs[k].r_end = tran->begin + tran->run_ends[i];
+        }
+    }
+
+    t = now();
+    n = __log_merge(log, k);
+    t = now() - t;
+    printf("merge\t%u runs\t%u entries\t%.3f ms\n", k, nr, t * 1e3);
+
+    if (n != nr_pages + nr_metas) {
+        fprintf(stderr, "[Err] merged %u entries but expects %u.\n",
+                n, nr_pages + nr_metas);
+        return -1;
+    }
+    for (i = 0; i < n; ++i, prev = le) {
+        le = L_ENT(log, mg->out[i]);
+        if (le_inval(le) || (prev && le_key(prev) > le_key(le))) {
+            fprintf(stderr, "[Err] merged entries out of order at %u.\n", i);
+            return -1;
+        }
+        if (le_meta(le)) continue;
+        ino = le_ino(le);
+        pgi = le_pgi(le);
+        if (mg->out[i] != last[ino][pgi] || le_len(le) != max_len[ino][pgi]) {
+            fprintf(stderr, "[Err] page (%lu, %lu) collapsed wrongly.\n",
+                    ino, pgi);
+            return -1;
+        }
+    }
+
+    log_destroy(log);
+    free(log);
     return 0;
 }
+
+static void append_range(struct adafs_log *log, unsigned long ino,
+        unsigned long pgi, unsigned int nr, unsigned int len) {
+    struct log_entry entry = LE_INITIALIZER;
+
+    le_set_ino(&entry, ino);
+    le_init_pgi(&entry, pgi);
+    le_init_len(&entry, len);
+    le_set_nr_pages(&entry, nr);
+    log_append(log, &entry, NULL);
+}
+
+// Newer entries within older ranges, as COW of their pages appends
+static int test_merge_range(void) {
+    struct adafs_log *log = new_log(NULL, LOG_DEF_LEN, LOG_DEF_LEN);
+    struct log_merger *mg;
+    struct transaction *tran;
+    struct log_entry *le;
+    // Expected output: (ino, pgi, pages, len)
+    static const unsigned int exp[][4] = {
+        { 1, 10, 4, 100 }, { 1, 10, 1, PAGE_CACHE_SIZE },
+        { 1, 12, 1, PAGE_CACHE_SIZE }, { 1, 13, 2, 30 }, { 1, 20, 1, 300 },
+        { 2, 5, 3, 40 },
+    };
+    unsigned int i, k = 0, n;
+
+    if (!log) return -1;
+    mg = &log->l_merger;
+    append_range(log, 1, 10, 4, 100);
+    append_range(log, 1, 20, 1, 300);
+    append_range(log, 2, 5, 1, 7);
+    log_seal(log);
+    append_range(log, 1, 12, 1, 50);    // within the range
+    append_range(log, 1, 20, 1, 10);    // collapses as before
+    append_range(log, 1, 13, 2, 30);    // at its last page
+    append_range(log, 1, 10, 1, 5);     // at its first page
+    append_range(log, 2, 5, 3, 40);     // over an older page
+    log_seal(log);
+
+    list_for_each_entry(tran, &log->l_trans, list) {
+        if (is_tran_open(tran) || !tran->nr_runs) break;
+        for (i = 0; i < tran->nr_runs; ++i, ++k) {
+            mg->runs[k].r_next = tran->begin + (i ? tran->run_ends[i - 1] : 0);
+            mg->runs[k].r_end = tran->begin + tran->run_ends[i];
+        }
+    }
+    n = __log_merge(log, k);
+
+    if (n != sizeof(exp) / sizeof(exp[0])) {
+        fprintf(stderr, "[Err] merged %u entries of ranges but expects %lu.\n",
+                n, sizeof(exp) / sizeof(exp[0]));
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        le = L_ENT(log, mg->out[i]);
+        if (le_ino(le) != exp[i][0] || le_pgi(le) != exp[i][1] ||
+                le_nr_pages(le) != exp[i][2] || le_len(le) != exp[i][3]) {
+            fprintf(stderr, "[Err] merged range entry wrongly at %u: "
+                    "ino=%u, pgi=%u, pages=%u, len=%u\n", i, le_ino(le),
+                    le_pgi(le), le_nr_pages(le), le_len(le));
+            return -1;
+        }
+    }
+    if (le_valid(L_ENT(log, 2))) {
+        fprintf(stderr, "[Err] page under a newer range is not dropped.\n");
+        return -1;
+    }
+
+    log_destroy(log);
+    free(log);
+    return 0;
+}
+
+int main(int argc, const char *argv[]) {
+    struct adafs_log *log = new_log(NULL, LOG_DEF_LEN * 2, LOG_DEF_LEN * 2);
+    struct log_entry *saved;
+    // Sorted ranges start within segments of the attached slots
+    unsigned int begin = 1000;
+    int i, dist, err = 0, failed = 0;
+    unsigned int k;
+    double t, t_qsort, t_radix;
+
+    if (!log) return -1;
+    saved = (struct log_entry *)malloc(LOG_DEF_LEN * sizeof(struct log_entry));
+
+    printf("dist\tentries\tqsort(ms)\tradix(ms)\n");
+    for (dist = 0; dist < NR_DISTS; ++dist) {
+        t_qsort = t_radix = 0;
+        for (i = 0; i < NR_ROUNDS; ++i) {
+            fill(log, begin, dist);
+            for (k = 0; k < LOG_DEF_LEN; ++k) saved[k] = *L_ENT(log, begin + k);
+
+            t = now();
+            err = __log_sort(log, begin, begin + LOG_DEF_LEN);
+            t_radix += now() - t;
+            if (err || check(log, begin, log->l_sorter.sorted)) {
+                fprintf(stderr, "[Err] radix sort of %s input is wrong.\n",
+                        dist_names[dist]);
+                failed = 1;
+            }
+
+            t = now();
+            err = __log_qsort(log, begin, begin + LOG_DEF_LEN);
+            t_qsort += now() - t;
+            if (err) {
+                fprintf(stderr, "[Warn] qsort of %s input failed: %d\n",
+                        dist_names[dist], err);
+            }
+            for (k = 0; k < LOG_DEF_LEN; ++k) *L_ENT(log, begin + k) = saved[k];
+        }
+        printf("%s\t%d\t%.3f\t%.3f\n", dist_names[dist], LOG_DEF_LEN,
+                t_qsort * 1e3 / NR_ROUNDS, t_radix * 1e3 / NR_ROUNDS);
+        begin += LOG_DEF_LEN / 3;
+    }
+
+    if (test_merge()) failed = 1;
+    if (test_merge_range()) failed = 1;
+
+    log_destroy(log);
+    free(log);
+    free(saved);
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed;
+}
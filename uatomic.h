@@ -138,5 +138,54 @@ static inline int atomic_inc_return(atomic_t *v) {
   return __sync_add_and_fetch(&v->counter, 1);
 }
 
+/**
+ * Atomic long type, as in the kernel.
+ */
+typedef struct {
+    volatile long counter;
+} atomic_long_t;
+
+#define ATOMIC_LONG_INIT(i)  { (i) }
+
+#define atomic_long_read(v) ((v)->counter)
+
+#define atomic_long_set(v,i) (((v)->counter) = (i))
+
+static inline void atomic_long_add(long i, atomic_long_t *v)
+{
+       (void)__sync_add_and_fetch(&v->counter, i);
+}
+
+static inline void atomic_long_inc(atomic_long_t *v)
+{
+       (void)__sync_add_and_fetch(&v->counter, 1);
+}
+
+static inline void atomic_long_sub(long i, atomic_long_t *v)
+{
+       (void)__sync_sub_and_fetch(&v->counter, i);
+}
+
+static inline long atomic_long_add_return(long i, atomic_long_t *v)
+{
+       return __sync_add_and_fetch(&v->counter, i);
+}
+
+static inline long atomic_long_xchg(atomic_long_t *v, long i)
+{
+       return __atomic_exchange_n(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Compare and exchange on a plain variable
+ * @param ptr pointer to the variable
+ * @param o expected old value
+ * @param n new value
+ *
+ * Returns the value of *@ptr before the operation, which equals
+ * @o on success. Implies a full memory barrier.
+ */
+#define cmpxchg(ptr, o, n) __sync_val_compare_and_swap((ptr), (o), (n))
+
 #endif
 